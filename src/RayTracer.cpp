@@ -3,6 +3,7 @@
 
 #include "RayTracer.h"
 
+#include "scene/BVH.h"
 #include "scene/material.h"
 #include "scene/ray.h"
 
@@ -13,6 +14,7 @@
 
 #include "ui/TraceUI.h"
 #include <algorithm>
+#include <chrono>
 #include <cmath>
 #include <glm/glm.hpp>
 #include <glm/gtx/io.hpp>
@@ -37,6 +39,9 @@ bool debugMode = false;
 
 // Constant to stop the supersampling recursion
 static const double supersampling_recursion = 4;
+// Adaptive supersampling only ever samples points of a lattice this many
+// points per pixel (a side): the corners of the deepest subdivision.
+static const int aaLattice = 2 << (int)supersampling_recursion;
 
 static const bool doJitterAntiAliasing = false;
 
@@ -55,6 +60,8 @@ glm::dvec3 RayTracer::trace(double x, double y) {
   if (TraceUI::m_debug) {
     scene->clearIntersectCache();
   }
+  // No hit record from the previous primary ray is still alive.
+  isect::releaseScratchMaterials();
   // pp position or origin, dd direction, w: wavelength? ray's power?, tt = raytype=VISIBILITY
   // TODO:confirm
   ray r(glm::dvec3(0, 0, 0), glm::dvec3(0, 0, 0), glm::dvec3(1, 1, 1),
@@ -69,27 +76,22 @@ glm::dvec3 RayTracer::trace(double x, double y) {
   glm::dvec3 threshold = glm::dvec3(1.0, 1.0, 1.0);
   // traceUI->getDepth() returns the max depth of recursion 
   // glm::dvec3(1.0, 1.0, 1.0) = &thresh: Threshold for interpolation within block?
+  // Left unclamped: the framebuffer is linear HDR, and getBuffer() tone maps.
   glm::dvec3 ret = 
       traceRay(r, threshold, traceUI->getDepth(), dummy);
-  // Returns min(max(x, minVal), maxVal) for each component in x using the floating-point
-  // values minVal and maxVal.
-  // Restrict the values to lie between 0 and 1
-  ret = glm::clamp(ret, 0.0, 1.0);
   return ret;
 }
 
 // computes the color of a specific pixel (i, j) in a ray-traced scene and updates 
 // the pixel buffer with this color.
-glm::dvec3 RayTracer::tracePixel(int i, int j) {
+glm::dvec3 RayTracer::tracePixel(int i, int j, SampleCache *cache) {
   glm::dvec3 col(0, 0, 0);
 
   if (!sceneLoaded())
     return col;
 
-  unsigned char *pixel = buffer.data() + (i + j * buffer_width) * 3;
   if(!traceUI->aaSwitch()) {
     // cout<<"TracePixel: "<<buffer_width<<" "<<buffer_height<<"\n";
-    // calculates the address of the pixel in the buffer, *3 bc there are 3 colors?
 
     // normalized window coordinates (x,y)
     double x = double(i) / double(buffer_width);
@@ -98,44 +100,58 @@ glm::dvec3 RayTracer::tracePixel(int i, int j) {
     col = trace(x, y);
   } else if (!doJitterAntiAliasing) {
     unsigned int *numRays = aaNumRaysPerPixel.data() + (i + j * buffer_width);
-    glm::dvec2 center = glm::dvec2((i + 0.5)/double(buffer_width), (j + 0.5)/double(buffer_height));
-    col = adaptative_supersampling(center, 1, numRays[0]);
+    // A pixel on its own still shares the samples between its levels.
+    SampleCache pixelCache;
+    col = adaptative_supersampling(cache ? *cache : pixelCache,
+                                   i * aaLattice + aaLattice / 2,
+                                   j * aaLattice + aaLattice / 2, 1,
+                                   numRays[0]);
   } else {
-    // Jitter (Stochastic) Anti-Aliasing
-    for (int k = 0; k < samples; k++) {
-      for (int l = 0; l < samples; l++) {
-        // We wanna make sure that after adding the random noise, the new x,y are still in the planned subpixel
-        double jitterX = (((double)rand()) / RAND_MAX)/(double(buffer_width) * samples);
-        double jitterY = (((double)rand()) / RAND_MAX)/(double(buffer_height) * samples);
-        double x = (double(i) + double(k)/samples)/double(buffer_width) + jitterX;
-        double y = (double(j) + double(l)/samples)/double(buffer_height) + jitterY;
-
-        col += trace(x,y);
-      }
+    // Jitter (Stochastic) Anti-Aliasing. The pixel seeds its own sampler,
+    // so the points do not depend on which thread traces it, or when.
+    Sampler sampler(samplerType, i, j, samples);
+    for (int k = 0; k < sampler.count(); k++) {
+      glm::dvec2 p = sampler.get2D(k);
+      double x = (double(i) + p.x)/double(buffer_width);
+      double y = (double(j) + p.y)/double(buffer_height);
+
+      col += trace(x,y);
     }
-    col = col / (double)(samples*samples);
+    col = col / (double)sampler.count();
   }
-    // map the values in col (in the range [0, 1]) to integers in the range [0, 255] RGB colors
-    pixel[0] = (int)(255.0 * col[0]);
-    pixel[1] = (int)(255.0 * col[1]);
-    pixel[2] = (int)(255.0 * col[2]);
-  
+  setPixel(i, j, col);
+  return col;
+}
+// The color at lattice point (x, y), aaLattice points per pixel, traced the
+// first time it is asked for.
+glm::dvec3 RayTracer::traceSample(SampleCache &cache, int x, int y,
+                                  unsigned int &numRays) {
+  uint64_t key = (uint64_t)(uint32_t)y << 32 | (uint32_t)x;
+  auto found = cache.find(key);
+  if (found != cache.end())
+    return found->second;
+  numRays++;
+  glm::dvec3 col = trace(x / double(buffer_width * aaLattice),
+                         y / double(buffer_height * aaLattice));
+  cache.emplace(key, col);
   return col;
 }
-// TODO: include memorize hash or matrix
-glm::dvec3 RayTracer::adaptative_supersampling(glm::dvec2 center, int depth, unsigned int &numRays) {
 
-  // cout<<"RayTracer.cpp RayTracer::adaptative_supersampling "<<center[0]<<" "<<center[1]<<" "<<depth<<"\n";
+// Sample the square of half-size aaLattice >> depth lattice points around
+// (x, y) at its center and corners, and subdivide the quadrants whose
+// corner differs too much from the center. Neighbouring pixels share
+// corners and every quadrant shares one corner and the center with its
+// parent, so the samples come from the cache whenever they can.
+glm::dvec3 RayTracer::adaptative_supersampling(SampleCache &cache, int x, int y, int depth, unsigned int &numRays) {
+  int half = aaLattice >> depth;
 
-  // unsigned char *pixel = tempBuffer + (i + j * buffer_width) * 3;
-  glm::dvec3 traced_center = trace(center.x, center.y);
+  glm::dvec3 traced_center = traceSample(cache, x, y, numRays);
 
-  glm::dvec3 top_left = trace(center.x - pow(0.5, depth)/(double) buffer_width, center.y - pow(0.5, depth)/(double) buffer_height);
-  glm::dvec3 top_right = trace(center.x - pow(0.5, depth)/(double) buffer_width, center.y + pow(0.5, depth)/(double) buffer_height);
-  glm::dvec3 bottom_left = trace(center.x + pow(0.5, depth)/(double) buffer_width, center.y - pow(0.5, depth)/(double) buffer_height);
-  glm::dvec3 bottom_right = trace(center.x + pow(0.5, depth)/(double) buffer_width, center.y + pow(0.5, depth)/(double) buffer_height);
+  glm::dvec3 top_left = traceSample(cache, x - half, y - half, numRays);
+  glm::dvec3 top_right = traceSample(cache, x - half, y + half, numRays);
+  glm::dvec3 bottom_left = traceSample(cache, x + half, y - half, numRays);
+  glm::dvec3 bottom_right = traceSample(cache, x + half, y + half, numRays);
 
-  numRays += 5;
   if (depth > supersampling_recursion) {
     return ((double)4 * traced_center + top_left + top_right + bottom_left + bottom_right) / (double)8;
   }
@@ -146,30 +162,31 @@ glm::dvec3 RayTracer::adaptative_supersampling(glm::dvec2 center, int depth, uns
   double color_dist4 = (double)colour_dist(bottom_right, traced_center);
 
   glm::dvec3 result(0, 0, 0);
+  int quarter = half / 2;
 
   if (color_dist1 > aaThresh) {
-    result += adaptative_supersampling(glm::dvec2(center.x - pow(0.5, depth+1)/(double) buffer_width, center.y - pow(0.5, depth+1)/(double) buffer_height), depth + 1, numRays);
+    result += adaptative_supersampling(cache, x - quarter, y - quarter, depth + 1, numRays);
   }
   else {
     result += (traced_center + top_left)/ (double)2;
   }
 
   if (color_dist2 > aaThresh) {
-    result += adaptative_supersampling(glm::dvec2(center.x - pow(0.5, depth+1)/(double) buffer_width, center.y + pow(0.5, depth+1)/(double) buffer_height), depth + 1, numRays);
+    result += adaptative_supersampling(cache, x - quarter, y + quarter, depth + 1, numRays);
   }
   else {
     result += (traced_center + top_right)/ (double)2;
   }
 
   if (color_dist3 > aaThresh) {
-    result += adaptative_supersampling(glm::dvec2(center.x + pow(0.5, depth+1)/(double) buffer_width, center.y - pow(0.5, depth+1)/(double) buffer_height), depth + 1, numRays);
+    result += adaptative_supersampling(cache, x + quarter, y - quarter, depth + 1, numRays);
   }
   else {
     result += (traced_center + bottom_left)/ (double)2;
   }
 
   if (color_dist4 > aaThresh) {
-    result += adaptative_supersampling(glm::dvec2(center.x + pow(0.5, depth+1)/(double) buffer_width, center.y + pow(0.5, depth+1)/(double) buffer_height), depth + 1, numRays);
+    result += adaptative_supersampling(cache, x + quarter, y + quarter, depth + 1, numRays);
   }
   else {
     result += (traced_center + bottom_right)/ (double)2;
@@ -180,9 +197,10 @@ glm::dvec3 RayTracer::adaptative_supersampling(glm::dvec2 center, int depth, uns
 
 }
 
+// Distance between the colors as displayed, so clamped to [0, 1].
 double RayTracer::colour_dist(glm::dvec3 e1, glm::dvec3 e2) {
-    glm::dvec3 e1_255 = 255.0 * e1;
-    glm::dvec3 e2_255 = 255.0 * e2;
+    glm::dvec3 e1_255 = 255.0 * glm::clamp(e1, 0.0, 1.0);
+    glm::dvec3 e2_255 = 255.0 * glm::clamp(e2, 0.0, 1.0);
     long rmean = ((long) e1_255.x + (long) e2_255.x) / 2;
     long r = (long)e1_255.x - (long)e2_255.x;
     long g = (long)e1_255.y - (long)e2_255.y;
@@ -197,13 +215,22 @@ double RayTracer::colour_dist(glm::dvec3 e1, glm::dvec3 e2) {
 glm::dvec3 RayTracer::traceRay(ray &r, const glm::dvec3 &thresh, int depth,
                                double &t) {
   isect i;
-  glm::dvec3 colorC;
 #if VERBOSE
   std::cerr << "== current depth: " << depth << std::endl;
 #endif
   // Get any intersection with an object.  Return information about the
   // intersection through the reference parameter.
-  if (scene->intersect(r, i)) {
+  bool hit = scene->intersect(r, i);
+  return shadeRay(r, hit, i, thresh, depth, t);
+}
+
+// The color of ray r, given what it hit (if anything). Split from traceRay()
+// so rays intersected as a packet are shaded the same way.
+glm::dvec3 RayTracer::shadeRay(ray &r, bool hit, isect &i,
+                               const glm::dvec3 &thresh, int depth,
+                               double &t) {
+  glm::dvec3 colorC;
+  if (hit) {
     // YOUR CODE HERE
 
     // An intersection occurred!  We've got work to do. For now, this code gets
@@ -226,112 +253,19 @@ glm::dvec3 RayTracer::traceRay(ray &r, const glm::dvec3 &thresh, int depth,
     // TODO: include traceUI->getMaxDepth() which returns the max recursion limit?
     // it is not necessary since the HW will be graded with recursion = 5
 
-    // Reflection: recursively call traceRay
-    // if depth > 0 and the material is reflective we consider reflections
-    glm::dvec3 pos = r.at(i.getT());
-    if (m.Refl() && depth > 0) {
-      // r.at(i.getT()) gives you the intersection of ray with the surface: p + (t * d)
-      // in this case r.at(i.getT()) = position
-      glm::dvec3 w_in = r.getDirection();
-      glm::dvec3 N = i.getN();
-      // direction: w_ref normalize
-      glm::dvec3 w_ref = glm::normalize(w_in - 2 * glm::dot(N, w_in)*N);
-      ray r_reflection(pos, w_ref, glm::dvec3(1, 1, 1),
-          ray::REFLECTION);
-      glm::dvec3 thresh_refl = thresh * m.kr(i);
-      if (thresh_refl.x > reflection_treshold.x || thresh_refl.y > reflection_treshold.y ||
-        thresh_refl.z > reflection_treshold.z) {
-        colorC += m.kr(i) * traceRay(r_reflection, thresh_refl, depth - 1, t);
-      }
-    }
-
-    // TODO: for refraction he said mantain a stack to know if u are inside or outside an object
-    
-    // Refraction
-    if (m.Trans() && depth > 0) {
-      // refractive index m.index(i);
-      // transmission angle
-      glm::dvec3 V = -1.0 * r.getDirection();
-      // if cos < 0 we are inside the object and the normal should be negative
-      // if cos > 0 we are comming from outside of the object, so normal stay positive
-      double cos_i = glm::dot(i.getN(), V);
-      glm::dvec3 N = i.getN();
-      double n_1;
-      double n_2;
-      // TODO: what if cos_i > 0, <0 or = 0, maybe replace the first if for cos_i and add elseif and else
-      if (cos_i > 0) { // entering the object
-        n_1 = 1.0;
-        n_2 = m.index(i);
-      } else if (cos_i < 0) { // we are inside an object, therefore, exiting the object
-        n_1 = m.index(i);
-        n_2 = 1.0;
-        // normal should be negative
-        N = -1.0 * N;
-        // therefore it changes the cos_i
-        cos_i = glm::dot(N, V);
-      } else {
-				N = glm::dvec3 (0,0,0);
-			}
-      double cos_i_2 = pow(cos_i, 2);
-      double eta = n_1 / n_2;
-      double cos_t_2 = 1 - pow(eta, 2) * (1 - cos_i_2);
-      double cos_t = glm::sqrt(cos_t_2);
-
-      // check if we consider total internal reflection or not
-      if (cos_t_2 >= RAY_EPSILON) { // we have refraction
-        // TODO: confirm signs, maybe I forgot to change something
-        //changed
-        glm::dvec3 t_refract = glm::normalize(glm::refract(r.getDirection(), N, eta));
-        // glm::dvec3 t_refract = glm::normalize((eta * cos_i - cos_t) * N - (eta * V));
-        // changed
-        ray r_refraction(pos, t_refract, glm::dvec3(1, 1, 1), ray::REFRACTION);
-        // ray r_refraction(pos, t_refract, glm::dvec3(1, 1, 1), ray::REFRACTION);
-        // TODO: scale by distance
-        isect iRefract; 
-        double d = 1.0;
-        if (scene->intersect(r_refraction, iRefract)) {
-          double d = iRefract.getT();
-        }
-        // TODO: confirm if m.kt(i) goes here
-        // colorC += traceRay(r_refraction, thresh, depth - 1, t) * pow(m.kt(i), glm::dvec3(d));
-        colorC += traceRay(r_refraction, thresh, depth - 1, t);
-      } else if (m.Refl()) { // the square root is imaginary so we have total internal reflection
-        // TODO: since the reference does not have this, confirm if it's better w/o this.
-        glm::dvec3 r_t_reflection = glm::normalize(-r.getDirection() + 2 * glm::dot(r.getDirection(), N) * N);
-        ray t_i_reflection(pos, r_t_reflection, glm::dvec3(1, 1, 1), ray::REFLECTION);
-        isect iReflect; 
-        double d = 1.0;
-        if (scene->intersect(t_i_reflection, iReflect)) {
-          double d = iReflect.getT();
-        }
-        // TODO: confirm if we multiply by m.kr(i) or not here
-        // colorC += m.kr(i) * traceRay(t_i_reflection, thresh, depth - 1, t);
-        // changed:
-        glm::dvec3 reflection_kr_index = m.kr(i) * pow(m.kt(i), glm::dvec3(d));
-        glm::dvec3 thresh_refrac = thresh * reflection_kr_index;
-        if (thresh_refrac.x > refrac_reflect_treshold.x && thresh_refrac.y > refrac_reflect_treshold.y &&
-        thresh_refrac.z > refrac_reflect_treshold.z) {
-          colorC += reflection_kr_index * traceRay(t_i_reflection, thresh_refrac, depth - 1, t);
-        }
-      }   
-    }
+    // Reflection and refraction: recursively call traceRay
+    spawnSecondary(r, i, thresh,
+                   [&](const glm::dvec3 &pos, const glm::dvec3 &dir,
+                       ray::RayType type, const glm::dvec3 &weight,
+                       const glm::dvec3 &threshChild) {
+                     ray child(pos, dir, glm::dvec3(1, 1, 1), type);
+                     colorC += weight *
+                               traceRay(child, threshChild, depth - 1, t);
+                   });
     return colorC;
 
   } else {
-    // No intersection. This ray travels to infinity, so we color
-    // it according to the background color, which in this (simple)
-    // case is just black.
-    //
-    // FIXME: Add CubeMap support here.
-    // TIPS: CubeMap object can be fetched from
-    // traceUI->getCubeMap();
-    //       Check traceUI->cubeMap() to see if cubeMap is loaded
-    //       and enabled.
-    if (traceUI->cubeMap()) {
-	colorC = traceUI->getCubeMap()->getColor(r);
-    } else {
-	colorC = glm::dvec3(0.0, 0.0, 0.0);
-    }
+    colorC = background(r);
   }
 #if VERBOSE
   std::cerr << "== depth: " << depth + 1 << " done, returning: " << colorC
@@ -340,15 +274,109 @@ glm::dvec3 RayTracer::traceRay(ray &r, const glm::dvec3 &thresh, int depth,
   return colorC;
 }
 
+// No intersection. This ray travels to infinity, so we color it according
+// to the background color, which is the cube map if one is loaded and black
+// otherwise.
+glm::dvec3 RayTracer::background(const ray &r) {
+  if (traceUI->cubeMap())
+    return traceUI->getCubeMap()->getColor(r);
+  return glm::dvec3(0.0, 0.0, 0.0);
+}
+
+// The reflected and refracted rays leaving the hit i of ray r. For each one
+// worth tracing, calls
+//   emit(position, direction, type, weight, thresh)
+// where weight scales the color the ray brings back and thresh is its share
+// of the contribution to the pixel (rays below a threshold are dropped).
+template <typename Emit>
+void RayTracer::spawnSecondary(const ray &r, const isect &i,
+                               const glm::dvec3 &thresh, Emit emit) {
+  const Material &m = i.getMaterial();
+  // if the material is reflective we consider reflections
+  glm::dvec3 pos = r.at(i.getT());
+  if (m.Refl()) {
+    // r.at(i.getT()) gives you the intersection of ray with the surface: p + (t * d)
+    // in this case r.at(i.getT()) = position
+    glm::dvec3 w_in = r.getDirection();
+    glm::dvec3 N = i.getN();
+    // direction: w_ref normalize
+    glm::dvec3 w_ref = glm::normalize(w_in - 2 * glm::dot(N, w_in)*N);
+    glm::dvec3 thresh_refl = thresh * m.kr(i);
+    if (thresh_refl.x > reflection_treshold.x || thresh_refl.y > reflection_treshold.y ||
+      thresh_refl.z > reflection_treshold.z) {
+      emit(pos, w_ref, ray::REFLECTION, m.kr(i), thresh_refl);
+    }
+  }
+
+  // TODO: for refraction he said mantain a stack to know if u are inside or outside an object
+
+  // Refraction
+  if (m.Trans()) {
+    // refractive index m.index(i);
+    // transmission angle
+    glm::dvec3 V = -1.0 * r.getDirection();
+    // if cos < 0 we are inside the object and the normal should be negative
+    // if cos > 0 we are comming from outside of the object, so normal stay positive
+    double cos_i = glm::dot(i.getN(), V);
+    glm::dvec3 N = i.getN();
+    double n_1;
+    double n_2;
+    // TODO: what if cos_i > 0, <0 or = 0, maybe replace the first if for cos_i and add elseif and else
+    if (cos_i > 0) { // entering the object
+      n_1 = 1.0;
+      n_2 = m.index(i);
+    } else if (cos_i < 0) { // we are inside an object, therefore, exiting the object
+      n_1 = m.index(i);
+      n_2 = 1.0;
+      // normal should be negative
+      N = -1.0 * N;
+      // therefore it changes the cos_i
+      cos_i = glm::dot(N, V);
+    } else {
+      N = glm::dvec3 (0,0,0);
+    }
+    double cos_i_2 = pow(cos_i, 2);
+    double eta = n_1 / n_2;
+    double cos_t_2 = 1 - pow(eta, 2) * (1 - cos_i_2);
+
+    // check if we consider total internal reflection or not
+    if (cos_t_2 >= RAY_EPSILON) { // we have refraction
+      glm::dvec3 t_refract = glm::normalize(glm::refract(r.getDirection(), N, eta));
+      // glm::dvec3 t_refract = glm::normalize((eta * cos_i - cos_t) * N - (eta * V));
+      // TODO: scale by distance, e.g. by pow(m.kt(i), glm::dvec3(d))
+      emit(pos, t_refract, ray::REFRACTION, glm::dvec3(1, 1, 1), thresh);
+    } else if (m.Refl()) { // the square root is imaginary so we have total internal reflection
+      // TODO: since the reference does not have this, confirm if it's better w/o this.
+      glm::dvec3 r_t_reflection = glm::normalize(-r.getDirection() + 2 * glm::dot(r.getDirection(), N) * N);
+      // TODO: scale by the distance d travelled inside; for now d = 1
+      double d = 1.0;
+      glm::dvec3 reflection_kr_index = m.kr(i) * pow(m.kt(i), glm::dvec3(d));
+      glm::dvec3 thresh_refrac = thresh * reflection_kr_index;
+      if (thresh_refrac.x > refrac_reflect_treshold.x && thresh_refrac.y > refrac_reflect_treshold.y &&
+      thresh_refrac.z > refrac_reflect_treshold.z) {
+        emit(pos, r_t_reflection, ray::REFLECTION, reflection_kr_index, thresh_refrac);
+      }
+    }
+  }
+}
+
 RayTracer::RayTracer()
-    : scene(nullptr), buffer(0), thresh(0), buffer_width(0), buffer_height(0),
-      m_bBufferReady(false) {
+    : stopTrace(false), scene(nullptr), buffer(0), thresh(0),
+      buffer_width(0), buffer_height(0), m_bBufferReady(false) {
 }
 
-RayTracer::~RayTracer() {}
+RayTracer::~RayTracer() {
+  stopTrace = true;
+  waitRender();
+}
 
+// The framebuffer tone mapped to 8-bit RGB, as of now: while a render
+// runs, whatever its pixels hold so far.
 void RayTracer::getBuffer(unsigned char *&buf, int &w, int &h) {
-  buf = buffer.data();
+  displayBuffer.resize(buffer.size());
+  ToneMap::quantize(toneMap, buffer.data(), displayBuffer.data(),
+                    buffer.size());
+  buf = displayBuffer.data();
   w = buffer_width;
   h = buffer_height;
 }
@@ -379,6 +407,10 @@ bool RayTracer::loadScene(const char *fn) {
   else
     path = path.substr(0, path.find_last_of("\\/"));
 
+  // Never swap the scene out from under running render workers.
+  stopTrace = true;
+  waitRender();
+
   if (isRay) {
     // .ray Parsing Path
     // Call this with 'true' for debug output from the tokenizer
@@ -421,9 +453,32 @@ bool RayTracer::loadScene(const char *fn) {
   if (!sceneLoaded())
     return false;
 
+  buildBVH();
   return true;
 }
 
+// Bring the scene's BVH up to date with the current TraceUI settings. The
+// scene keeps its tree between renders, so this only builds after a load or
+// a change to one of the BVH settings, and only refits it after objects
+// were moved.
+void RayTracer::buildBVH() {
+  BVHBuildOptions bvhOptions;
+  bvhOptions.method = traceUI->bvhSAH() ? BVHBuildOptions::SAH
+                                        : BVHBuildOptions::MEDIAN;
+  bvhOptions.numBins = traceUI->getBvhBins();
+  bvhOptions.leafCost = traceUI->getBvhLeafCost();
+  bvhOptions.refitRebuildRatio = traceUI->getBvhRefitRatio();
+  bvhOptions.maxLeafSize = traceUI->getLeafSize();
+  bvhOptions.maxDepth = traceUI->getMaxDepth();
+  bvhOptions.wide = traceUI->bvhWide();
+  bvhOptions.numThreads = threadCount();
+  if (scene->buildBVH(bvhOptions) && traceUI->bvhStats()) {
+    scene->getBVH()->getStats().print(std::cout);
+    std::cout << "BVH build time, meshes included: "
+              << scene->getBVH()->getBuildTime() * 1000.0 << " ms" << std::endl;
+  }
+}
+
 void RayTracer::traceSetup(int w, int h) {
   size_t newBufferSize = w * h * 3;
   if (newBufferSize != buffer.size()) {
@@ -432,17 +487,30 @@ void RayTracer::traceSetup(int w, int h) {
   }
   buffer_width = w;
   buffer_height = h;
-  std::fill(buffer.begin(), buffer.end(), 0);
+  std::fill(buffer.begin(), buffer.end(), 0.0f);
   m_bBufferReady = true;
 
   /*
    * Sync with TraceUI
    */
 
-  threads = traceUI->getThreads();
+  threads = threadCount();
   block_size = traceUI->getBlockSize();
   thresh = traceUI->getThreshold();
   samples = traceUI->getSuperSamples();
+  // With anti-aliasing, aaImage() supersamples around pixel centers, so the
+  // one sample of the other pixels goes there too.
+  sampleOffset = traceUI->aaSwitch() ? 0.5 : 0.0;
+  if (!Sampler::typeFromName(traceUI->getSampler(), samplerType)) {
+    traceUI->alert("Unknown sampler '" + traceUI->getSampler() +
+                   "', using stratified.");
+    samplerType = Sampler::STRATIFIED;
+  }
+  if (!ToneMap::typeFromName(traceUI->getToneMap(), toneMap)) {
+    traceUI->alert("Unknown tone map '" + traceUI->getToneMap() +
+                   "', using linear.");
+    toneMap = ToneMap::LINEAR;
+  }
   aaThresh = traceUI->getAaThreshold()*1000; // We revert the multiplication by 0.001 here because we wanna use the original value instead of scaling it between 0 to 1.
 
   if (traceUI->aaSwitch() && !doJitterAntiAliasing) {
@@ -468,16 +536,25 @@ void RayTracer::traceSetup(int w, int h) {
  *
  */
 void RayTracer::traceImage(int w, int h) {
+  // Finish (or abandon) whatever is still rendering into the buffer.
+  stopProgressive();
+  waitRender();
+
   // Always call traceSetup before rendering anything.
   traceSetup(w, h);
-  scene->buildBVH();
-  for (int i = 0; i < w; i++)
-  {
-    for (int j = 0; j < h; j++) {
-      tracePixel(i, j);
-    }
+
+  buildBVH();
+
+  if (traceUI->progressive()) {
+    startProgressive();
+    return;
   }
 
+  startJob({0, 0, w, h}, renderTileSize(),
+           [this](unsigned int worker, const Tile &tile) {
+    renderTile(worker, tile);
+  });
+
   /*
   * Uncomment this piece of code to output the antialiasing ray sampling intensity instead of the output raytraced image
   */
@@ -512,117 +589,496 @@ void RayTracer::traceImage(int w, int h) {
   //     }
   //   }
   // }
-  
-  // YOUR CODE HERE
-  // FIXME: Start one or more threads for ray tracing
-  //
-  // TIPS: Ideally, the traceImage should be executed asynchronously,
-  //       i.e. returns IMMEDIATELY after working threads are launched.
-  //
-  //       An asynchronous traceImage lets the GUI update your results
-  //       while rendering.
 }
 
+/*
+ * RayTracer::traceRegion
+ *
+ *	Re-trace a rectangle [x0, x1) x [y0, y1) of the current image, e.g. after
+ *	an edit that only affects part of the frame. Like traceImage this runs
+ *	asynchronously on the render pool.
+ */
+void RayTracer::traceRegion(int x0, int y0, int x1, int y1) {
+  stopProgressive();
+  waitRender();
+  if (!sceneLoaded() || buffer.empty())
+    return;
+
+  x0 = std::max(x0, 0);
+  y0 = std::max(y0, 0);
+  x1 = std::min(x1, buffer_width);
+  y1 = std::min(y1, buffer_height);
+  if (x0 >= x1 || y0 >= y1)
+    return;
+
+  startJob({x0, y0, x1, y1}, renderTileSize(),
+           [this](unsigned int worker, const Tile &tile) {
+    renderTile(worker, tile);
+  });
+}
+
+// The threads TraceUI asks for, for both the BVH build and the render pool.
+// ray_thread_id picks the thread's RayStats block, so never run more
+// workers than there are blocks.
+int RayTracer::threadCount() const {
+  return std::min(std::max(traceUI->getThreads(), 1), MAX_THREADS);
+}
+
+// Cut the region into tileSize tiles and hand them to the render pool.
+// The job runs detached from the caller; checkRender() polls it and
+// waitRender() blocks on it. Setting stopTrace cancels it between tiles.
+void RayTracer::startJob(const Tile &region, int tileSize,
+                         RenderPool::TileFunc func) {
+  pool.resize(threads);
+  stopTrace = false;
+  pool.submit(region, tileSize, std::move(func), &stopTrace);
+}
+
+/*
+ * Progressive rendering
+ *
+ *	A driver thread runs one pass after another on the render pool, so the
+ *	image is there to look at early and keeps improving:
+ *
+ *	- coarse passes trace one sample for every PROGRESSIVE_BLOCK pixels
+ *	  square and show it over the whole block, then halve the block until
+ *	  every pixel has its sample (where the one-sample render puts it), and
+ *	- refinement passes add one more sample per pixel each, from the
+ *	  pixel's Sampler, into the accumulation buffer; the image shows the
+ *	  mean. The coarse samples only stand in until then: they sit wherever
+ *	  the one-sample render puts them, so they would skew the mean.
+ *
+ *	The refinement passes go round a side x side sampler grid. It stops
+ *	when stopTrace is set (even halfway through a pass, which is why every
+ *	pixel keeps its own count), after one round of a grid holding
+ *	getProgressiveSamples() samples (rounded down to a square), or at the
+ *	end of the first round that ends after getProgressiveTime() seconds, so
+ *	every stratum has as many samples as the others. Zero means no such
+ *	limit.
+ */
+void RayTracer::startProgressive() {
+  accumBuffer.assign(buffer_width * buffer_height * 3, 0.0f);
+  accumCount.assign(buffer_width * buffer_height, 0);
+  pool.resize(threads);
+  stopTrace = false;
+  progressiveRunning = true;
+  progressiveThread = std::thread(&RayTracer::traceProgressive, this);
+}
+
+void RayTracer::traceProgressive() {
+  auto start = std::chrono::steady_clock::now();
+  const int maxSamples = traceUI->getProgressiveSamples();
+  const double timeBudget = traceUI->getProgressiveTime();
+  auto outOfTime = [&] {
+    std::chrono::duration<double> elapsed =
+        std::chrono::steady_clock::now() - start;
+    return timeBudget > 0.0 && elapsed.count() >= timeBudget;
+  };
+  // Runs on this thread, not through startJob(), which would clear a
+  // stopTrace set meanwhile.
+  auto runPass = [this](RenderPool::TileFunc func) {
+    pool.submit({0, 0, buffer_width, buffer_height}, block_size,
+                std::move(func), &stopTrace);
+    pool.wait();
+  };
+
+  for (int step = PROGRESSIVE_BLOCK; step >= 1 && !stopTrace; step /= 2) {
+    runPass([this, step](unsigned int worker, const Tile &tile) {
+      ray_thread_id = worker;
+      traceCoarseTile(tile, step);
+    });
+  }
+  // The stratified sampler needs to know how many points it spreads over.
+  // Without a sample limit, the passes go round the supersampling grid.
+  int side = maxSamples > 0 ? std::max(1, (int)std::sqrt((double)maxSamples))
+                            : std::max(1, samples);
+  int round = side * side;
+  for (int pass = 1; !stopTrace; pass++) {
+    // Only stop between rounds.
+    if ((pass - 1) % round == 0 &&
+        ((maxSamples > 0 && pass > round) || outOfTime()))
+      break;
+    runPass([this, pass, side](unsigned int worker, const Tile &tile) {
+      ray_thread_id = worker;
+      refineTile(tile, pass, side);
+    });
+  }
+  progressiveRunning = false;
+}
+
+// A progressive render may have no limit, so rather than wait for it, stop
+// it.
+void RayTracer::stopProgressive() {
+  if (progressiveRunning) {
+    stopTrace = true;
+    waitRender();
+    stopTrace = false;
+  }
+}
+
+// The samples of one coarse pass that fall into the tile: the pixels on
+// multiples of step, less those a coarser pass already traced. Each one's
+// color fills its step x step block, which no other sample of the pass
+// touches, so blocks may reach into other tiles. None of them goes into the
+// accumulation buffer.
+void RayTracer::traceCoarseTile(const Tile &tile, int step) {
+  for (int j = tile.y0; j < tile.y1; j++) {
+    if (j % step)
+      continue;
+    for (int i = tile.x0; i < tile.x1; i++) {
+      if (i % step || (step < PROGRESSIVE_BLOCK && i % (2 * step) == 0 &&
+                       j % (2 * step) == 0))
+        continue;
+      glm::dvec3 col = trace((i + sampleOffset) / double(buffer_width),
+                             (j + sampleOffset) / double(buffer_height));
+      for (int y = j; y < std::min(j + step, buffer_height); y++)
+        for (int x = i; x < std::min(i + step, buffer_width); x++)
+          setPixel(x, y, col);
+    }
+  }
+}
+
+// Sample number pass of every pixel of the tile.
+void RayTracer::refineTile(const Tile &tile, int pass, int side) {
+  for (int j = tile.y0; j < tile.y1; j++) {
+    for (int i = tile.x0; i < tile.x1; i++) {
+      glm::dvec2 p = Sampler(samplerType, i, j, side).get2D(pass - 1);
+      glm::dvec3 col = trace((i + p.x) / double(buffer_width),
+                             (j + p.y) / double(buffer_height));
+      setPixel(i, j, accumulate(i, j, col));
+    }
+  }
+}
+
+// Add a sample to pixel (i, j) of the accumulation buffer; returns the mean.
+glm::dvec3 RayTracer::accumulate(int i, int j, const glm::dvec3 &col) {
+  int n = i + j * buffer_width;
+  float *sum = accumBuffer.data() + n * 3;
+  int count = ++accumCount[n];
+  for (int c = 0; c < 3; c++)
+    sum[c] += (float)col[c];
+  return glm::dvec3(sum[0], sum[1], sum[2]) / (double)count;
+}
+
+// Whether renderTile() uses the wavefront tracer.
+bool RayTracer::wavefrontTiles() const {
+  return traceUI->wavefront() && !TraceUI::m_debug;
+}
+
+int RayTracer::renderTileSize() const {
+  return wavefrontTiles() ? std::max(block_size, (int)WAVEFRONT_TILE)
+                          : block_size;
+}
+
+// One sample per pixel; with anti-aliasing on, aaImage() then supersamples
+// the pixels on edges.
+void RayTracer::renderTile(unsigned int worker, const Tile &tile) {
+  ray_thread_id = worker;
+  if (!sceneLoaded())
+    return;
+  if (wavefrontTiles()) {
+    traceWavefront(tile);
+    return;
+  }
+  // One primary ray per pixel: trace them 4x4 pixels at a time, so the
+  // packet shares its walk through the BVH.
+  if (traceUI->packets() && !TraceUI::m_debug) {
+    for (int y = tile.y0; y < tile.y1; y += PACKET_SIDE) {
+      for (int x = tile.x0; x < tile.x1; x += PACKET_SIDE) {
+        tracePacket({x, y, std::min(x + PACKET_SIDE, tile.x1),
+                     std::min(y + PACKET_SIDE, tile.y1)});
+      }
+    }
+    return;
+  }
+  for (int j = tile.y0; j < tile.y1; j++) {
+    for (int i = tile.x0; i < tile.x1; i++) {
+      setPixel(i, j, trace((i + sampleOffset) / double(buffer_width),
+                           (j + sampleOffset) / double(buffer_height)));
+    }
+  }
+}
+
+// What renderTile() does for every pixel of a block of
+// at most PACKET_SIDE x PACKET_SIDE pixels. The primary rays are intersected
+// together and then shaded one by one; secondary rays are traced alone.
+void RayTracer::tracePacket(const Tile &block) {
+  if (!sceneLoaded())
+    return;
+
+  std::vector<ray> rays;
+  rays.reserve(RayPacket::SIZE);
+  for (int j = block.y0; j < block.y1; j++) {
+    for (int i = block.x0; i < block.x1; i++) {
+      rays.emplace_back(glm::dvec3(0, 0, 0), glm::dvec3(0, 0, 0),
+                        glm::dvec3(1, 1, 1), ray::VISIBILITY);
+      scene->getCamera().rayThrough((i + sampleOffset) / double(buffer_width),
+                                    (j + sampleOffset) / double(buffer_height),
+                                    rays.back());
+    }
+  }
+
+  RayPacket packet;
+  packet.init(rays.data(), (int)rays.size());
+  // Rays that spread over more than one octant gain little from sharing
+  // the traversal; those are traced one by one.
+  isect hits[RayPacket::SIZE];
+  RayPacket::Mask found = 0;
+  if (packet.coherent)
+    found = scene->intersectPacket(packet, rays.data(), hits);
+  glm::dvec3 threshold = glm::dvec3(1.0, 1.0, 1.0);
+  int k = 0;
+  for (int j = block.y0; j < block.y1; j++) {
+    for (int i = block.x0; i < block.x1; i++, k++) {
+      // No hit record from the previous primary ray is still alive.
+      isect::releaseScratchMaterials();
+      double dummy;
+      glm::dvec3 col =
+          packet.coherent
+              ? shadeRay(rays[k], (found >> k) & 1, hits[k], threshold,
+                         traceUI->getDepth(), dummy)
+              : traceRay(rays[k], threshold, traceUI->getDepth(), dummy);
+      setPixel(i, j, col);
+    }
+  }
+}
+
+namespace {
+
+// A secondary ray waiting in a wavefront stream, with the state of the path
+// it continues: the pixel it adds to, the product of the weights of the
+// bounces so far, and its share of the pixel (for the cut-off thresholds).
+struct StreamRay {
+  glm::dvec3 position;
+  glm::dvec3 direction;
+  ray::RayType type;
+  int pixel;
+  glm::dvec3 weight;
+  glm::dvec3 thresh;
+};
+
+// Spread the low 10 bits of x out to every third bit.
+uint32_t spreadBits(uint32_t x) {
+  x &= 0x3ff;
+  x = (x | (x << 16)) & 0x030000ff;
+  x = (x | (x << 8)) & 0x0300f00f;
+  x = (x | (x << 4)) & 0x030c30c3;
+  x = (x | (x << 2)) & 0x09249249;
+  return x;
+}
+
+// Sort key that puts rays likely to visit the same BVH nodes next to each
+// other: the octant of the direction, then the Morton code of the origin
+// on a 1024^3 grid over the scene bounds.
+uint64_t streamKey(const StreamRay &s, const BoundingBox &bounds) {
+  uint64_t key = 0;
+  uint32_t morton = 0;
+  glm::dvec3 extent = bounds.getMax() - bounds.getMin();
+  for (int axis = 0; axis < 3; axis++) {
+    key |= uint64_t(s.direction[axis] < 0.0) << (32 + axis);
+    double x = extent[axis] > 0.0
+                   ? (s.position[axis] - bounds.getMin()[axis]) / extent[axis]
+                   : 0.0;
+    uint32_t cell = (uint32_t)glm::clamp(x * 1024.0, 0.0, 1023.0);
+    morton |= spreadBits(cell) << axis;
+  }
+  return key | morton;
+}
+
+} // anonymous namespace
+
+/*
+ * RayTracer::traceWavefront
+ *
+ *	Trace a tile breadth first instead of depth first: all rays of one bounce
+ *	form a stream that is sorted by direction and origin, intersected in
+ *	batches (as packets, when a batch is coherent enough), and only then
+ *	shaded. Shading adds each hit's light to its pixel, scaled by the
+ *	weights of the bounces that led there, and emits the stream of the next
+ *	bounce. Shadow rays are still traced by the materials as they shade.
+ *
+ *	Gives what the other renderTile() paths give, up to rounding: the
+ *	color of a path is summed in a different order.
+ */
+void RayTracer::traceWavefront(const Tile &tile) {
+  if (!sceneLoaded())
+    return;
+
+  const int width = tile.x1 - tile.x0;
+  const int numPixels = width * (tile.y1 - tile.y0);
+  std::vector<glm::dvec3> color(numPixels, glm::dvec3(0, 0, 0));
+  std::vector<ray> rays;
+  std::vector<StreamRay> paths; // paths[k] is continued by rays[k]
+  rays.reserve(numPixels);
+  paths.reserve(numPixels);
+
+  // Primary rays, in PACKET_SIDE x PACKET_SIDE blocks so that consecutive
+  // batches are the same packets tracePacket() would use.
+  for (int y = tile.y0; y < tile.y1; y += PACKET_SIDE) {
+    for (int x = tile.x0; x < tile.x1; x += PACKET_SIDE) {
+      for (int j = y; j < std::min(y + PACKET_SIDE, tile.y1); j++) {
+        for (int i = x; i < std::min(x + PACKET_SIDE, tile.x1); i++) {
+          rays.emplace_back(glm::dvec3(0, 0, 0), glm::dvec3(0, 0, 0),
+                            glm::dvec3(1, 1, 1), ray::VISIBILITY);
+          scene->getCamera().rayThrough(
+              (i + sampleOffset) / double(buffer_width),
+              (j + sampleOffset) / double(buffer_height), rays.back());
+          StreamRay path;
+          path.pixel = (i - tile.x0) + (j - tile.y0) * width;
+          path.weight = glm::dvec3(1, 1, 1);
+          path.thresh = glm::dvec3(1, 1, 1);
+          paths.push_back(path);
+        }
+      }
+    }
+  }
+
+  std::vector<isect> hits;
+  std::vector<char> hit;
+  std::vector<StreamRay> next;
+  std::vector<std::pair<uint64_t, uint32_t>> order;
+  for (int depth = traceUI->getDepth(); !rays.empty(); depth--) {
+    // Intersect.
+    const size_t count = rays.size();
+    hits.assign(count, isect());
+    hit.assign(count, 0);
+    for (size_t b = 0; b < count; b += RayPacket::SIZE) {
+      int size = (int)std::min(count - b, (size_t)RayPacket::SIZE);
+      RayPacket packet;
+      packet.init(&rays[b], size);
+      if (traceUI->packets() && packet.coherent) {
+        RayPacket::Mask found =
+            scene->intersectPacket(packet, &rays[b], &hits[b]);
+        for (int k = 0; k < size; k++)
+          hit[b + k] = (found >> k) & 1;
+      } else {
+        for (int k = 0; k < size; k++)
+          hit[b + k] = scene->intersect(rays[b + k], hits[b + k]);
+      }
+    }
+
+    // Shade, and collect the next bounce.
+    isect::releaseScratchMaterials();
+    next.clear();
+    for (size_t k = 0; k < count; k++) {
+      const StreamRay &path = paths[k];
+      if (!hit[k]) {
+        color[path.pixel] += path.weight * background(rays[k]);
+        continue;
+      }
+      const Material &m = hits[k].getMaterial();
+      color[path.pixel] += path.weight * m.shade(scene.get(), rays[k], hits[k]);
+      if (depth <= 0)
+        continue;
+      spawnSecondary(rays[k], hits[k], path.thresh,
+                     [&](const glm::dvec3 &pos, const glm::dvec3 &dir,
+                         ray::RayType type, const glm::dvec3 &weight,
+                         const glm::dvec3 &thresh) {
+                       next.push_back({pos, dir, type, path.pixel,
+                                       path.weight * weight, thresh});
+                     });
+    }
+
+    // Sort the next bounce into coherent runs and make its rays.
+    order.resize(next.size());
+    for (size_t k = 0; k < next.size(); k++)
+      order[k] = {streamKey(next[k], scene->bounds()), (uint32_t)k};
+    std::sort(order.begin(), order.end());
+    rays.clear();
+    paths.clear();
+    // Reserve first, so that growing the vector doesn't reallocate it.
+    rays.reserve(order.size());
+    for (const auto &entry : order) {
+      const StreamRay &s = next[entry.second];
+      rays.emplace_back(s.position, s.direction, glm::dvec3(1, 1, 1), s.type);
+      paths.push_back(s);
+    }
+  }
+
+  for (int j = tile.y0; j < tile.y1; j++) {
+    for (int i = tile.x0; i < tile.x1; i++) {
+      setPixel(i, j, color[(i - tile.x0) + (j - tile.y0) * width]);
+    }
+  }
+}
+
+/*
+ * RayTracer::aaImage
+ *
+ *	Second pass of anti-aliasing, after traceImage() has traced one sample
+ *	per pixel: flag the pixels whose color differs from one of their eight
+ *	neighbours by more than aaThresh (by colour_dist), and supersample only
+ *	those, on the render pool. Like traceImage this runs asynchronously.
+ *	Returns the number of pixels flagged.
+ */
 int RayTracer::aaImage() {
-  // YOUR CODE HERE
-  // FIXME: Implement Anti-aliasing here
-
-  // WE HAVE REMOVED THIS CODE BECAUSE WE ARE NOW DOING ADAPTIVE ANTI-ALIASING NOW INSTEAD
-
-//   // Nothing to do if we weren't oversampling
-//   if (samples<=1) {
-//     return 0;
-//   }
-
-//   int overSamplingFactor = samples*samples;
-//   int imageSize = buffer.size()/overSamplingFactor;
-
-//   int w = 0, h = 0;
-//   unsigned char *buf = NULL;
-//   getBuffer(buf, w, h);
-//   w = w/samples;
-//   h = h/samples;
-
-//   if (imageSize != w * h * 3) {
-//     // Current buffer size is not as expected - maybe aaImage has been called previously?
-//     // CommandLineUI explicitly calls it, but graphical UI doesn't I think?
-//     cout<<"Double call to aaImage?\n";
-//     return 0;
-//   }
-
-//   std::vector<unsigned char> tempBuffer(imageSize);
-
-//   // bool bufferzeros = std::all_of(buffer.begin(), buffer.end(), [](int i) { return i==0; });
-
-//   for (int j = 0; j < h; j++) {
-//     for (int i = 0; i < w; i++) {
-//       unsigned char *pixel = tempBuffer.data() + (i + j * w) * 3;
-//       // long int sum0 = 0, sum1 = 0, sum2 = 0; // TODO: Can we change this to a vector instead?
-//       glm::dvec3 sum = glm::dvec3(0, 0, 0);
-//       for (int l = 0; l < samples; l++) {
-//         for (int k = 0; k < samples; k++) {
-//           unsigned char *bufferLoc = buf + (j*w*samples*samples + l*w*samples + i*samples + k) * 3;
-//           sum += glm::dvec3((int)bufferLoc[0], (int)bufferLoc[1], (int)bufferLoc[2]);
-//           // sum0 += (int)bufferLoc[0];
-//           // sum1 += (int)bufferLoc[1];
-//           // sum2 += (int)bufferLoc[2];
-//         }
-//       }
-//       pixel[0] = (int)(sum.x/overSamplingFactor);
-//       pixel[1] = (int)(sum.y/overSamplingFactor);
-//       pixel[2] = (int)(sum.z/overSamplingFactor);
-//     }
-//   }
-
-//   // bool tempBufferZeros = std::all_of(tempBuffer.begin(), tempBuffer.end(), [](int i) { return i==0; });
-
-//   size_t newBufferSize = imageSize;;
-//   if (newBufferSize != buffer.size()) {
-//     bufferSize = newBufferSize;
-//     buffer.resize(bufferSize);
-//   }
-//   buffer_width = w;
-//   buffer_height = h;
-//   buffer.assign(tempBuffer.begin(), tempBuffer.end());
-
-  // std::fill(buffer.begin(), buffer.end(), 0);
-  // m_bBufferReady = true;
-
-  // TIP: samples and aaThresh have been synchronized with TraceUI by
-  //      RayTracer::traceSetup() function
-  return 0;
+  waitRender();
+  if (!sceneLoaded() || buffer.empty())
+    return 0;
+
+  const int w = buffer_width;
+  const int h = buffer_height;
+  aaMask.assign(w * h, 0);
+  int flagged = 0;
+  for (int j = 0; j < h; j++) {
+    for (int i = 0; i < w; i++) {
+      glm::dvec3 col = getPixel(i, j);
+      bool edge = false;
+      for (int dj = -1; dj <= 1 && !edge; dj++) {
+        for (int di = -1; di <= 1 && !edge; di++) {
+          int ni = i + di, nj = j + dj;
+          if (ni < 0 || ni >= w || nj < 0 || nj >= h || (di == 0 && dj == 0))
+            continue;
+          edge = colour_dist(col, getPixel(ni, nj)) > aaThresh;
+        }
+      }
+      if (edge) {
+        aaMask[i + j * w] = 1;
+        flagged++;
+      }
+    }
+  }
+
+  startJob({0, 0, w, h}, block_size,
+           [this](unsigned int worker, const Tile &tile) {
+    ray_thread_id = worker;
+    // Flagged pixels next to each other share their border samples.
+    SampleCache cache;
+    for (int j = tile.y0; j < tile.y1; j++) {
+      for (int i = tile.x0; i < tile.x1; i++) {
+        if (aaMask[i + j * buffer_width])
+          tracePixel(i, j, &cache);
+      }
+    }
+  });
+  return flagged;
 }
 
+// Returns true once every render worker has run out of tiles (or noticed
+// stopTrace), and a progressive render has run its last pass. Used by the
+// GUI to poll the asynchronous traceImage.
 bool RayTracer::checkRender() {
-  // YOUR CODE HERE
-  // FIXME: Return true if tracing is done.
-  //        This is a helper routine for GUI.
-  //
-  // TIPS: Introduce an array to track the status of each worker thread.
-  //       This array is maintained by the worker threads.
-  return true;
+  return !progressiveRunning && pool.done();
 }
 
+// Block until the current render job is done. The workers themselves stay
+// parked in the pool for the next job.
 void RayTracer::waitRender() {
-  // YOUR CODE HERE
-  // FIXME: Wait until the rendering process is done.
-  //        This function is essential if you are using an asynchronous
-  //        traceImage implementation.
-  //
-  // TIPS: Join all worker threads here.
+  if (progressiveThread.joinable())
+    progressiveThread.join();
+  pool.wait();
 }
 
 
 glm::dvec3 RayTracer::getPixel(int i, int j) {
-  unsigned char *pixel = buffer.data() + (i + j * buffer_width) * 3;
-  return glm::dvec3((double)pixel[0] / 255.0, (double)pixel[1] / 255.0,
-                    (double)pixel[2] / 255.0);
+  float *pixel = buffer.data() + (i + j * buffer_width) * 3;
+  return glm::dvec3(pixel[0], pixel[1], pixel[2]);
 }
 
 void RayTracer::setPixel(int i, int j, glm::dvec3 color) {
-  unsigned char *pixel = buffer.data() + (i + j * buffer_width) * 3;
+  float *pixel = buffer.data() + (i + j * buffer_width) * 3;
 
-  pixel[0] = (int)(255.0 * color[0]);
-  pixel[1] = (int)(255.0 * color[1]);
-  pixel[2] = (int)(255.0 * color[2]);
+  pixel[0] = (float)color[0];
+  pixel[1] = (float)color[1];
+  pixel[2] = (float)color[2];
 }
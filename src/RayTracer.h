@@ -5,13 +5,18 @@
 
 // The main ray tracer.
 
+#include "RenderPool.h"
+#include "Sampler.h"
+#include "ToneMap.h"
 #include "scene/cubeMap.h"
 #include "scene/ray.h"
+#include <atomic>
 #include <glm/vec3.hpp>
 #include <mutex>
 #include <queue>
 #include <thread>
 #include <time.h>
+#include <unordered_map>
 
 class Scene;
 class Pixel {
@@ -29,24 +34,34 @@ public:
   RayTracer();
   ~RayTracer();
 
-  glm::dvec3 tracePixel(int i, int j);
+  // Colors of the adaptive anti-aliasing samples traced so far, by their
+  // point on the sub-pixel lattice.
+  typedef std::unordered_map<uint64_t, glm::dvec3> SampleCache;
+
+  glm::dvec3 tracePixel(int i, int j, SampleCache *cache = nullptr);
   glm::dvec3 traceRay(ray &r, const glm::dvec3 &thresh, int depth,
                       double &length);
+  glm::dvec3 shadeRay(ray &r, bool hit, isect &i, const glm::dvec3 &thresh,
+                      int depth, double &length);
+  glm::dvec3 background(const ray &r);
 
   glm::dvec3 getPixel(int i, int j);
   void setPixel(int i, int j, glm::dvec3 color);
   void getBuffer(unsigned char *&buf, int &w, int &h);
   double aspectRatio();
 
-  glm::dvec3 adaptative_supersampling(glm::dvec2 center, int depth, unsigned int &numRays);
+  glm::dvec3 adaptative_supersampling(SampleCache &cache, int x, int y, int depth, unsigned int &numRays);
+  glm::dvec3 traceSample(SampleCache &cache, int x, int y, unsigned int &numRays);
   double colour_dist(glm::dvec3 e1, glm::dvec3 e2);
 
   void traceImage(int w, int h);
+  void traceRegion(int x0, int y0, int x1, int y1);
   int aaImage();
   bool checkRender();
   void waitRender();
 
   void traceSetup(int w, int h);
+  void buildBVH();
 
   bool loadScene(const char *fn);
   bool sceneLoaded() { return scene != 0; }
@@ -56,14 +71,48 @@ public:
 
   const Scene &getScene() { return *scene; }
 
-  bool stopTrace;
+  std::atomic<bool> stopTrace;
 
 private:
+  // Primary rays go out in packets of PACKET_SIDE x PACKET_SIDE pixels.
+  static const int PACKET_SIDE = 4;
+  // The wavefront tracer works on tiles of at least this many pixels a
+  // side, so each bounce has enough rays to sort into coherent batches.
+  static const int WAVEFRONT_TILE = 32;
+  // The first progressive pass traces one sample per block this size.
+  static const int PROGRESSIVE_BLOCK = 8;
+
   glm::dvec3 trace(double x, double y);
+  template <typename Emit>
+  void spawnSecondary(const ray &r, const isect &i, const glm::dvec3 &thresh,
+                      Emit emit);
+  void startJob(const Tile &region, int tileSize, RenderPool::TileFunc func);
+  int threadCount() const;
+  bool wavefrontTiles() const;
+  int renderTileSize() const;
+  void renderTile(unsigned int worker, const Tile &tile);
+  void tracePacket(const Tile &block);
+  void traceWavefront(const Tile &tile);
+  void startProgressive();
+  void stopProgressive();
+  void traceProgressive();
+  void traceCoarseTile(const Tile &tile, int step);
+  void refineTile(const Tile &tile, int pass, int side);
+  glm::dvec3 accumulate(int i, int j, const glm::dvec3 &col);
+
+  // Worker threads shared by every render job, kept alive between frames
+  RenderPool pool;
 
   std::unique_ptr<Scene> scene;
-  std::vector<unsigned char> buffer;
+  std::vector<float> buffer; // linear RGB, unclamped
+  std::vector<unsigned char> displayBuffer; // buffer as getBuffer() last gave it
   std::vector<unsigned int> aaNumRaysPerPixel; // Only used for adaptive anti-aliasing
+  std::vector<char> aaMask; // pixels aaImage() supersamples
+  // Progressive rendering: the sum of each pixel's samples, and their number
+  std::vector<float> accumBuffer;
+  std::vector<int> accumCount;
+  std::thread progressiveThread; // runs the passes
+  std::atomic<bool> progressiveRunning{false};
   double thresh;
   int buffer_width, buffer_height;
   bool m_bBufferReady;
@@ -72,6 +121,9 @@ private:
   unsigned int threads;
   int block_size;
   double aaThresh;
+  double sampleOffset = 0.0; // where in its pixel the first pass samples
+  Sampler::Type samplerType = Sampler::STRATIFIED;
+  ToneMap::Type toneMap = ToneMap::LINEAR;
   int samples;
 
 };
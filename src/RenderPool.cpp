@@ -0,0 +1,72 @@
+#include "RenderPool.h"
+
+RenderPool::~RenderPool() { shutdown(); }
+
+void RenderPool::resize(unsigned int workers) {
+  if (workers == threads.size())
+    return;
+  shutdown();
+
+  std::lock_guard<std::mutex> guard(lock);
+  stopping = false;
+  for (unsigned int k = 0; k < workers; k++)
+    threads.emplace_back(&RenderPool::workerLoop, this, k, generation);
+}
+
+void RenderPool::shutdown() {
+  wait();
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    stopping = true;
+  }
+  wake.notify_all();
+  for (auto &thread : threads)
+    thread.join();
+  threads.clear();
+}
+
+void RenderPool::submit(const Tile &region, int blockSize, TileFunc func,
+                        const std::atomic<bool> *cancelFlag) {
+  wait();
+  if (threads.empty())
+    return;
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    scheduler.reset(region, blockSize, (unsigned int)threads.size());
+    job = std::move(func);
+    cancel = cancelFlag;
+    // Every worker checks in once per job, even if it finds no tiles left,
+    // so the job is done exactly when all of them have.
+    busy = (unsigned int)threads.size();
+    generation++;
+  }
+  wake.notify_all();
+}
+
+void RenderPool::wait() {
+  std::unique_lock<std::mutex> guard(lock);
+  idle.wait(guard, [this] { return busy == 0; });
+}
+
+// 'seen' is the job generation at spawn time, handed in by resize() rather
+// than read here so a job submitted before the thread gets scheduled is not
+// missed.
+void RenderPool::workerLoop(unsigned int id, unsigned long seen) {
+  for (;;) {
+    {
+      std::unique_lock<std::mutex> guard(lock);
+      wake.wait(guard, [&] { return stopping || generation != seen; });
+      if (stopping)
+        return;
+      seen = generation;
+    }
+
+    Tile tile;
+    while (!(cancel && *cancel) && scheduler.next(id, tile))
+      job(id, tile);
+
+    std::lock_guard<std::mutex> guard(lock);
+    if (--busy == 0)
+      idle.notify_all();
+  }
+}
@@ -0,0 +1,62 @@
+#ifndef __RENDERPOOL_H__
+#define __RENDERPOOL_H__
+
+// A long-lived pool of render workers. The threads are started once and park
+// on a condition variable between jobs, so a GUI re-render, an animation
+// frame or a second anti-aliasing pass does not pay for thread start-up.
+
+#include "TileScheduler.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+class RenderPool {
+public:
+  // Work done for one tile; gets the index of the worker running it.
+  typedef std::function<void(unsigned int worker, const Tile &tile)> TileFunc;
+
+  RenderPool() {}
+  ~RenderPool();
+
+  RenderPool(const RenderPool &) = delete;
+  RenderPool &operator=(const RenderPool &) = delete;
+
+  // Grow or shrink the pool. Waits for the running job first.
+  void resize(unsigned int workers);
+  unsigned int size() const { return (unsigned int)threads.size(); }
+
+  // Start a job over the tiles of a region and return immediately. Workers
+  // check *cancel between tiles and drop the rest of the job once it is set.
+  void submit(const Tile &region, int blockSize, TileFunc func,
+              const std::atomic<bool> *cancel);
+
+  // True when no job is running.
+  bool done() const { return busy == 0; }
+
+  // Block until the running job (if any) is finished.
+  void wait();
+
+private:
+  void workerLoop(unsigned int id, unsigned long seen);
+  void shutdown();
+
+  std::vector<std::thread> threads;
+
+  std::mutex lock;
+  std::condition_variable wake; // a job was submitted, or shutdown
+  std::condition_variable idle; // the last worker finished its job
+
+  TileScheduler scheduler;
+  TileFunc job;
+  const std::atomic<bool> *cancel = nullptr;
+
+  unsigned long generation = 0; // bumped once per submitted job
+  std::atomic<unsigned int> busy{0};
+  bool stopping = false;
+};
+
+#endif // __RENDERPOOL_H__
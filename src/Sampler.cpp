@@ -0,0 +1,121 @@
+#include "Sampler.h"
+
+namespace {
+
+// SplitMix64 finalizer: spreads small, similar inputs (neighbouring pixel
+// coordinates) over all 64 bits.
+uint64_t mix(uint64_t x) {
+  x += 0x9e3779b97f4a7c15ull;
+  x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ull;
+  x = (x ^ (x >> 27)) * 0x94d049bb133111ebull;
+  return x ^ (x >> 31);
+}
+
+uint32_t reverseBits(uint32_t x) {
+  x = (x << 16) | (x >> 16);
+  x = ((x & 0x00ff00ff) << 8) | ((x & 0xff00ff00) >> 8);
+  x = ((x & 0x0f0f0f0f) << 4) | ((x & 0xf0f0f0f0) >> 4);
+  x = ((x & 0x33333333) << 2) | ((x & 0xcccccccc) >> 2);
+  x = ((x & 0x55555555) << 1) | ((x & 0xaaaaaaaa) >> 1);
+  return x;
+}
+
+// Second Sobol dimension, as a 32-bit fraction. Its generator matrix is
+// Pascal's triangle mod 2, so each set bit of the index toggles the next
+// row, v ^= v >> 1 (the first dimension is the bit reversal of the index).
+uint32_t sobol2(uint32_t index) {
+  uint32_t result = 0;
+  for (uint32_t v = 1u << 31; index; index >>= 1, v ^= v >> 1) {
+    if (index & 1)
+      result ^= v;
+  }
+  return result;
+}
+
+// Radical inverse of index in the given base: its digits mirrored around
+// the radix point.
+double radicalInverse(uint32_t base, uint64_t index) {
+  double inverse = 1.0 / base;
+  double factor = inverse;
+  double result = 0.0;
+  while (index) {
+    result += (index % base) * factor;
+    index /= base;
+    factor *= inverse;
+  }
+  return result;
+}
+
+double fraction(uint32_t x) { return x * (1.0 / 4294967296.0); }
+
+// Wrap into [0, 1) after adding a shift in [0, 1).
+double wrap(double x) { return x >= 1.0 ? x - 1.0 : x; }
+
+} // anonymous namespace
+
+PCG32::PCG32(uint64_t seed, uint64_t stream) : state(0), inc((stream << 1) | 1) {
+  next();
+  state += seed;
+  next();
+}
+
+uint32_t PCG32::next() {
+  uint64_t old = state;
+  state = old * 6364136223846793005ull + inc;
+  uint32_t xorshifted = (uint32_t)(((old >> 18) ^ old) >> 27);
+  uint32_t rot = (uint32_t)(old >> 59);
+  return (xorshifted >> rot) | (xorshifted << ((-rot) & 31));
+}
+
+Sampler::Sampler(Type type, int i, int j, int side, uint32_t frame)
+    : type(type), side(side > 0 ? side : 1) {
+  seed = mix(mix(mix((uint64_t)(uint32_t)i) ^ (uint32_t)j) ^ frame);
+  PCG32 rng(seed, 0);
+  shift[0] = rng.nextDouble();
+  shift[1] = rng.nextDouble();
+  scramble[0] = rng.next();
+  scramble[1] = rng.next();
+}
+
+glm::dvec2 Sampler::get2D(int index) const {
+  switch (type) {
+  case RANDOM: {
+    // Stream 0 went into the shifts; one stream per point after that.
+    PCG32 rng(seed, (uint64_t)index + 1);
+    double x = rng.nextDouble();
+    return glm::dvec2(x, rng.nextDouble());
+  }
+  case HALTON:
+    return glm::dvec2(wrap(radicalInverse(2, index) + shift[0]),
+                      wrap(radicalInverse(3, index) + shift[1]));
+  case SOBOL:
+    return glm::dvec2(fraction(reverseBits((uint32_t)index) ^ scramble[0]),
+                      fraction(sobol2((uint32_t)index) ^ scramble[1]));
+  case STRATIFIED:
+  default: {
+    // Past count(), the points go round the cells again, jittered anew.
+    int cell = index % count();
+    PCG32 rng(seed, (uint64_t)index + 1);
+    double x = rng.nextDouble();
+    double y = rng.nextDouble();
+    return glm::dvec2((cell % side + x) / side, (cell / side + y) / side);
+  }
+  }
+}
+
+bool Sampler::typeFromName(const std::string &name, Type &type) {
+  static const struct {
+    const char *name;
+    Type type;
+  } names[] = {{"random", RANDOM},
+               {"stratified", STRATIFIED},
+               {"halton", HALTON},
+               {"sobol", SOBOL}};
+  for (const auto &entry : names) {
+    if (name == entry.name) {
+      type = entry.type;
+      return true;
+    }
+  }
+  return false;
+}
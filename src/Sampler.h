@@ -0,0 +1,63 @@
+#ifndef __SAMPLER_H__
+#define __SAMPLER_H__
+
+// Sample points for supersampling. Nothing here is shared between threads:
+// every pixel seeds its own generator from its coordinates (and the frame
+// number), so a frame comes out bit for bit the same whatever the number of
+// threads or the order the tiles are traced in.
+
+#include <cstdint>
+#include <string>
+
+#include <glm/vec2.hpp>
+
+// PCG32 (O'Neill, "PCG: A Family of Simple Fast Space-Efficient
+// Statistically Good Algorithms for Random Number Generation", 2014): a
+// 64-bit LCG whose output is a permuted (xorshift, then rotated) 32 bits of
+// the state. Different streams give independent sequences for one seed.
+class PCG32 {
+public:
+  explicit PCG32(uint64_t seed, uint64_t stream = 0);
+
+  uint32_t next();
+  // Uniform in [0, 1).
+  double nextDouble() { return next() * (1.0 / 4294967296.0); }
+
+private:
+  uint64_t state;
+  uint64_t inc; // odd; picks the stream
+};
+
+// The points of one pixel, in [0, 1)^2 relative to its corner.
+class Sampler {
+public:
+  enum Type {
+    RANDOM,     // independent uniform points
+    STRATIFIED, // one jittered point per cell of a side x side grid
+    HALTON,     // Halton sequence in bases 2 and 3, randomly shifted
+    SOBOL       // first two Sobol dimensions, randomly digit-shifted
+  };
+
+  // Points for pixel (i, j) of the given frame, side * side of them.
+  Sampler(Type type, int i, int j, int side, uint32_t frame = 0);
+
+  int count() const { return side * side; }
+  // Point index, 0 <= index. The same index always gives the same point;
+  // the stratified points of index >= count() start over in the first cell
+  // (the others just carry on along their sequence).
+  glm::dvec2 get2D(int index) const;
+
+  // "random", "stratified", "halton" or "sobol"; false if name is none.
+  static bool typeFromName(const std::string &name, Type &type);
+
+private:
+  Type type;
+  int side;
+  uint64_t seed;
+  // Per-pixel offsets that decorrelate the low-discrepancy sequences of
+  // neighbouring pixels: added modulo 1 (Halton) or xor-ed in (Sobol).
+  double shift[2];
+  uint32_t scramble[2];
+};
+
+#endif // __SAMPLER_H__
@@ -0,0 +1,91 @@
+#ifndef __TRIANGLE_H__
+#define __TRIANGLE_H__
+
+#include <cstdint>
+
+#include <glm/geometric.hpp>
+#include <glm/vec3.hpp>
+
+// Ray/triangle intersection (Moller & Trumbore, "Fast, Minimum Storage
+// Ray/Triangle Intersection", 1997). Finds t and the barycentric coordinates
+// in one pass, without computing the plane of the triangle first, and bails
+// out as soon as one of the coordinates falls outside the triangle.
+//
+// Both sides of the triangle are hit. Edge points are tested inclusively
+// (u, v >= 0, u + v <= 1). That is not watertight: rounding can still put a
+// ray through the shared edge of two triangles just outside both.
+// On a hit, u and v are the weights of b and c (a gets 1 - u - v).
+inline bool intersectTriangle(const glm::dvec3 &origin,
+                              const glm::dvec3 &direction, const glm::dvec3 &a,
+                              const glm::dvec3 &b, const glm::dvec3 &c,
+                              double tMin, double &t, double &u, double &v) {
+  glm::dvec3 e1 = b - a;
+  glm::dvec3 e2 = c - a;
+  glm::dvec3 p = glm::cross(direction, e2);
+  double det = glm::dot(e1, p);
+  // Ray parallel to the plane of the triangle.
+  if (det == 0.0)
+    return false;
+  double invDet = 1.0 / det;
+
+  glm::dvec3 s = origin - a;
+  u = glm::dot(s, p) * invDet;
+  if (u < 0.0 || u > 1.0)
+    return false;
+
+  glm::dvec3 q = glm::cross(s, e1);
+  v = glm::dot(direction, q) * invDet;
+  if (v < 0.0 || u + v > 1.0)
+    return false;
+
+  t = glm::dot(e2, q) * invDet;
+  return t > tMin;
+}
+
+// The same test for the lanes of a ray packet given per axis, org[axis][k]
+// and dir[axis][k]. Every lane runs exactly the arithmetic of
+// intersectTriangle(), without its early exits, so the loop vectorizes and
+// the results match the single-ray test bit for bit. Returns the mask of
+// lanes among 'lanes' that hit closer than tMax[k], with t, u and v filled
+// in for those.
+template <int N>
+inline uint32_t intersectTrianglePacket(const double (&org)[3][N],
+                                        const double (&dir)[3][N], int size,
+                                        const glm::dvec3 &a, const glm::dvec3 &b,
+                                        const glm::dvec3 &c, double tMin,
+                                        const double *tMax, uint32_t lanes,
+                                        double *t, double *u, double *v) {
+  glm::dvec3 e1 = b - a;
+  glm::dvec3 e2 = c - a;
+  uint32_t hit = 0;
+  for (int k = 0; k < size; k++) {
+    // p = cross(direction, e2)
+    double px = dir[1][k] * e2.z - e2.y * dir[2][k];
+    double py = dir[2][k] * e2.x - e2.z * dir[0][k];
+    double pz = dir[0][k] * e2.y - e2.x * dir[1][k];
+    double det = e1.x * px + e1.y * py + e1.z * pz;
+    double invDet = 1.0 / det;
+
+    double sx = org[0][k] - a.x;
+    double sy = org[1][k] - a.y;
+    double sz = org[2][k] - a.z;
+    double uk = (sx * px + sy * py + sz * pz) * invDet;
+
+    // q = cross(s, e1)
+    double qx = sy * e1.z - e1.y * sz;
+    double qy = sz * e1.x - e1.z * sx;
+    double qz = sx * e1.y - e1.x * sy;
+    double vk = (dir[0][k] * qx + dir[1][k] * qy + dir[2][k] * qz) * invDet;
+    double tk = (e2.x * qx + e2.y * qy + e2.z * qz) * invDet;
+
+    bool in = det != 0.0 && !(uk < 0.0 || uk > 1.0) &&
+              !(vk < 0.0 || uk + vk > 1.0) && tk > tMin && tk < tMax[k];
+    t[k] = tk;
+    u[k] = uk;
+    v[k] = vk;
+    hit |= uint32_t(in) << k;
+  }
+  return hit & lanes;
+}
+
+#endif // __TRIANGLE_H__
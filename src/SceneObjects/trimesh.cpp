@@ -1,4 +1,5 @@
 #include "trimesh.h"
+#include "triangle.h"
 #include <algorithm>
 #include <assert.h>
 #include <cmath>
@@ -6,37 +7,44 @@
 #include <string.h>
 #include "../ui/TraceUI.h"
 #include <iostream>
+#include <limits>
 extern TraceUI *traceUI;
 extern TraceUI *traceUI;
 
 using namespace std;
 
-Trimesh::~Trimesh() {
-  for (auto f : faces)
-    delete f;
-}
-
 // must add vertices, normals, and materials IN ORDER
-void Trimesh::addVertex(const glm::dvec3 &v) { vertices.emplace_back(v); }
+void Trimesh::addVertex(const glm::dvec3 &v) { data->vertices.emplace_back(MeshVec3(v)); }
 
-void Trimesh::addNormal(const glm::dvec3 &n) { normals.emplace_back(n); }
+void Trimesh::addNormal(const glm::dvec3 &n) { data->normals.emplace_back(MeshVec3(n)); }
 
-void Trimesh::addColor(const glm::dvec3 &c) { vertColors.emplace_back(c); }
+void Trimesh::addColor(const glm::dvec3 &c) { data->vertColors.emplace_back(c); }
 
-void Trimesh::addUV(const glm::dvec2 &uv) { uvCoords.emplace_back(uv); }
+void Trimesh::addUV(const glm::dvec2 &uv) { data->uvCoords.emplace_back(uv); }
 
 // Returns false if the vertices a,b,c don't all exist
 bool Trimesh::addFace(int a, int b, int c) {
-  int vcnt = vertices.size();
+  int vcnt = data->vertices.size();
 
   if (a >= vcnt || b >= vcnt || c >= vcnt)
     return false;
 
-  TrimeshFace *newFace = new TrimeshFace(this, a, b, c, scene, &material);
-  if (!newFace->degen)
-    faces.push_back(newFace);
-  else
-    delete newFace;
+  // Compute the face normal here, not on the fly
+  const glm::dvec3 a_coords = data->vertex(a);
+  const glm::dvec3 b_coords = data->vertex(b);
+  const glm::dvec3 c_coords = data->vertex(c);
+
+  glm::dvec3 vab = (b_coords - a_coords);
+  glm::dvec3 vac = (c_coords - a_coords);
+  glm::dvec3 vcb = (b_coords - c_coords);
+
+  // Degenerate faces are dropped
+  if (glm::length(vab) == 0.0 || glm::length(vac) == 0.0 ||
+      glm::length(vcb) == 0.0)
+    return true;
+
+  data->faces.emplace_back(a, b, c);
+  data->faceNormals.push_back(MeshVec3(glm::normalize(glm::cross(vab, vac))));
 
   // Don't add faces to the scene's object list so we can cull by bounding
   // box
@@ -46,141 +54,250 @@ bool Trimesh::addFace(int a, int b, int c) {
 // Check to make sure that if we have per-vertex materials or normals
 // they are the right number.
 const char *Trimesh::doubleCheck() {
-  if (!vertColors.empty() && vertColors.size() != vertices.size())
+  const TrimeshData &mesh = *data;
+  if (!mesh.vertColors.empty() && mesh.vertColors.size() != mesh.vertices.size())
     return "Bad Trimesh: Wrong number of vertex colors.";
-  if (!uvCoords.empty() && uvCoords.size() != vertices.size())
+  if (!mesh.uvCoords.empty() && mesh.uvCoords.size() != mesh.vertices.size())
     return "Bad Trimesh: Wrong number of UV coordinates.";
-  if (!normals.empty() && normals.size() != vertices.size())
+  if (!mesh.normals.empty() && mesh.normals.size() != mesh.vertices.size())
     return "Bad Trimesh: Wrong number of normals.";
 
   return 0;
 }
 
 bool Trimesh::intersectLocal(ray &r, isect &i) const {
+  const LinearBVH &faceBVH = data->faceBVH;
   bool have_one = false;
-  for (auto face : faces) {
-    isect cur;
-    if (face->intersectLocal(r, cur)) {
-      if (!have_one || (cur.getT() < i.getT())) {
-        i = cur;
-        have_one = true;
+  if (faceBVH.empty()) {
+    RayStats::countTests(0, numFaces());
+    for (int f = 0; f < numFaces(); f++) {
+      isect cur;
+      if (intersectFace(f, r, cur)) {
+        if (!have_one || (cur.getT() < i.getT())) {
+          i = cur;
+          have_one = true;
+        }
       }
     }
+  } else {
+    have_one = faceBVH.traverse(r, std::numeric_limits<double>::infinity(),
+                                [&](uint32_t f, double &tMax) {
+      isect cur;
+      if (intersectFace(f, r, cur) && cur.getT() < tMax) {
+        i = cur;
+        tMax = cur.getT();
+        return true;
+      }
+      return false;
+    });
   }
   if (!have_one)
     i.setT(1000.0);
   return have_one;
 }
 
+void Trimesh::bakeTransform() {
+  // Other instances still need the data in its own space.
+  if (transform.kind() == MatrixTransform::IDENTITY || isShared())
+    return;
+  for (MeshVec3 &v : data->vertices)
+    v = MeshVec3(transform.localToGlobalCoords(glm::dvec3(v)));
+  for (MeshVec3 &n : data->normals)
+    n = MeshVec3(transform.localToGlobalCoordsNormal(glm::dvec3(n)));
+  for (MeshVec3 &n : data->faceNormals)
+    n = MeshVec3(transform.localToGlobalCoordsNormal(glm::dvec3(n)));
+  data->faceBVH.clear();
+  baked = transform.transform() * baked;
+  transform = MatrixTransform();
+  ComputeBoundingBox();
+}
+
+void Trimesh::setTransform(const MatrixTransform &transform) {
+  // The vertices already carry the baked part; apply only what is left.
+  // The face BVH stays valid, since it is in the vertices' coordinates.
+  SceneObject::setTransform(
+      MatrixTransform(transform.transform() * glm::inverse(baked)));
+}
+
+MatrixTransform Trimesh::getTransform() const {
+  return MatrixTransform(transform.transform() * baked);
+}
+
+void Trimesh::buildBVH(const BVHBuildOptions &options) {
+  TrimeshData &mesh = *data;
+  if (!mesh.faceBVH.empty() && mesh.bvhOptions.sameTree(options))
+    return;
+  std::vector<BoundingBox> faceBounds;
+  faceBounds.reserve(mesh.faces.size());
+  for (const glm::ivec3 &face : mesh.faces) {
+    glm::dvec3 a = mesh.vertex(face[0]);
+    glm::dvec3 b = mesh.vertex(face[1]);
+    glm::dvec3 c = mesh.vertex(face[2]);
+    BoundingBox bounds(glm::min(a, b), glm::max(a, b));
+    bounds.merge(BoundingBox(c, c));
+    faceBounds.push_back(bounds);
+  }
+  mesh.faceBVH.build(faceBounds, options);
+  mesh.bvhOptions = options;
+}
+
 // Intersect ray r with the triangle abc.  If it hits returns true,
 // and put the parameter in t and the barycentric coordinates of the
 // intersection in u (alpha) and v (beta).
-bool TrimeshFace::intersectLocal(ray &r, isect &i) const {
-  glm::dvec3 A = parent->vertices[ids[0]];
-  glm::dvec3 B = parent->vertices[ids[1]];
-  glm::dvec3 C = parent->vertices[ids[2]];
-  // TODO: confirm
+bool Trimesh::intersectFace(int face, ray &r, isect &i) const {
+  const TrimeshData &mesh = *data;
+  const glm::ivec3 &ids = mesh.faces[face];
   // checking bug of shadows with t >= epsilon (10^-6)
-  glm::dvec3 direction = r.getDirection();
-  glm::dvec3 origin = r.getPosition();
-  double t_num = glm::dot(A, normal);
-  t_num = t_num - glm::dot(origin, normal);
-  double t = t_num / glm::dot(direction, normal);
-  if (t <= 0.00000001) {
-    return false; 
-  }
-  // if P is inside, must be on correct side of lines
-  glm::dvec3 P = r.at(t);
-  // the following booleans should be true for the point to be inside
-  glm::dvec3 B_A = B - A;
-  glm::dvec3 C_B = C - B;
-  glm::dvec3 A_C = A - C;
-  glm::dvec3 P_A = P - A;
-  glm::dvec3 P_B = P - B;
-  glm::dvec3 P_C = P - C;
-  glm::dvec3 C_P = C - P;
-  glm::dvec3 C_A = C - A;
-  glm::dvec3 B_P = B - P;
-  glm::dvec3 A_P = A - P;
-  glm::dvec3 check_1_1 = glm::cross(B_A, P_A);
-  glm::dvec3 check_2_1 = glm::cross(C_B, P_B);
-  glm::dvec3 check_3_1 = glm::cross(A_C, P_C);
-  double check1 = glm::dot(normal, check_1_1);
-  double check2 = glm::dot(normal, check_2_1);
-  double check3 = glm::dot(normal, check_3_1);
-  if ((check1 >= 0 && check2 >= 0 && check3 >= 0)) {
-    // we have a collision
-    i.setObject(this->parent);
+  double t, u, v;
+  if (!intersectTriangle(r.getPosition(), r.getDirection(), mesh.vertex(ids[0]),
+                         mesh.vertex(ids[1]), mesh.vertex(ids[2]), RAY_EPSILON,
+                         t, u, v))
+    return false;
+
+  // we have a collision
+  setFaceHit(face, t, u, v, i);
+  return true;
+}
+
+void Trimesh::setFaceHit(int face, double t, double u, double v,
+                         isect &i) const {
+  const TrimeshData &mesh = *data;
+  const glm::ivec3 &ids = mesh.faces[face];
+  const glm::dvec3 normal = mesh.faceNormal(face);
+  i.setObject(this);
+  i.setFace(face);
+  i.setT(t);
+  // the barycentric coordinates
+  double m1 = 1.0 - u - v;
+  double m2 = u;
+  double m3 = v;
+
+  i.setBary(m1, m2, m3);
+
+  // TODO: Phong interpolation, confirm if we need to set the normals like this
+    // I think we can set the normal by check this boolean this->parent->vertNorms, bc how the json is read
+  if (vertNorms) {
+    glm::dvec3 n1 = m1 * mesh.normal(ids[0]);
+    glm::dvec3 n2 = m2 * mesh.normal(ids[1]);
+    glm::dvec3 n3 = m3 * mesh.normal(ids[2]);
+    glm::dvec3 new_normal = glm::normalize(n1 + n2 + n3);
+    i.setN(new_normal);
+  } else {
     i.setN(normal);
-    i.setMaterial(this->parent->getMaterial());
-    i.setT(t);
-    // get the barycentric coordinates
-    double abc = (glm::dot(glm::cross(B_A, C_A), normal));
-    double pbc = (glm::dot(glm::cross(B_P, C_P), normal));
-    double pca = (glm::dot(glm::cross(C_P, A_C), normal));
-    double m1 = (pbc / abc);
-    double m2 = (pca / abc);
-    double m3 = 1.0 - m1 - m2;
-
-    i.setBary(m1, m2, m3);
-
-    // TODO: Phong interpolation, confirm if we need to set the normals like this
-      // I think we can set the normal by check this boolean this->parent->vertNorms, bc how the json is read
-    if (parent->vertNorms) {
-      glm::dvec3 n1 = m1 * parent->normals[ids[0]];
-      glm::dvec3 n2 = m2 * parent->normals[ids[1]];
-      glm::dvec3 n3 = m3 * parent->normals[ids[2]];
-      glm::dvec3 new_normal = glm::normalize(n1 + n2 + n3);
-      i.setN(new_normal);
-    } else {
-      i.setN(normal);
-    }
-    //  - If the parent mesh has non-empty `uvCoords`, barycentrically interpolate
-    //      the UV coordinates of the three vertices of the face, then assign it to
-    //      the intersection using i.setUVCoordinates().
-    // TODO: confirm if this is correct, weird
-    if (!(this->parent->uvCoords).empty()) {
-      glm::dvec2 uv1 = m1 * parent->uvCoords[ids[0]];
-      glm::dvec2 uv2 = m2 * parent->uvCoords[ids[1]];
-      glm::dvec2 uv3 = m3 * parent->uvCoords[ids[2]];
-      glm::dvec2 uvcoordinates = glm::normalize(uv1 + uv2 + uv3);
-      i.setUVCoordinates(uvcoordinates);
-    // - Otherwise, if the parent mesh has non-empty `vertexColors`,
-    //    barycentrically interpolate the colors from the three vertices of the
-    //    face. Create a new material by copying the parent's material, set the
-    //    diffuse color of this material to the interpolated color, and then 
-    //    assign this material to the intersection.
-    } else if (!parent->vertColors.empty()) {
-      glm::dvec3 c1 = m1 * parent->vertColors[ids[0]];
-      glm::dvec3 c2 = m2 * parent->vertColors[ids[1]];
-      glm::dvec3 c3 = m3 * parent->vertColors[ids[2]];
-      glm::dvec3 new_color = glm::normalize(c1 + c2 + c3);
-      // confirm if & before m (&m) or not
-      // Material m = this->parent->getMaterial();
-      Material m = parent->getMaterial();
-      m.setDiffuse(new_color);
-      i.setMaterial(m);
-    } else {
-      i.setMaterial(parent->getMaterial());
-    }
-    return true;
   }
-  return false;
+  //  - If the parent mesh has non-empty `uvCoords`, barycentrically interpolate
+  //      the UV coordinates of the three vertices of the face, then assign it to
+  //      the intersection using i.setUVCoordinates().
+  // TODO: confirm if this is correct, weird
+  if (!mesh.uvCoords.empty()) {
+    glm::dvec2 uv1 = m1 * mesh.uvCoords[ids[0]];
+    glm::dvec2 uv2 = m2 * mesh.uvCoords[ids[1]];
+    glm::dvec2 uv3 = m3 * mesh.uvCoords[ids[2]];
+    glm::dvec2 uvcoordinates = glm::normalize(uv1 + uv2 + uv3);
+    i.setUVCoordinates(uvcoordinates);
+  // - Otherwise, if the parent mesh has non-empty `vertexColors`, the
+  //    material is interpolated from them (Trimesh::interpolateMaterial),
+  //    but only if shading actually asks for it.
+  }
+}
+
+RayPacket::Mask Trimesh::intersectPacket(const RayPacket &packet, ray *rays,
+                                         RayPacket::Mask lanes, double *tMax,
+                                         isect *hits) const {
+  const TrimeshData &mesh = *data;
+  if (transform.kind() != MatrixTransform::IDENTITY || mesh.faceBVH.empty())
+    return Geometry::intersectPacket(packet, rays, lanes, tMax, hits);
+
+  // Same as Geometry::intersect(): the faces are hit with unit directions,
+  // and t is scaled back to the length of the original direction.
+  const int size = packet.size;
+  RayPacket local = packet;
+  double length[RayPacket::SIZE];
+  for (int k = 0; k < size; k++) {
+    glm::dvec3 dir(packet.dir[0][k], packet.dir[1][k], packet.dir[2][k]);
+    length[k] = glm::length(dir);
+    dir = glm::normalize(dir);
+    for (int axis = 0; axis < 3; axis++)
+      local.dir[axis][k] = dir[axis];
+  }
+  local.update();
+
+  double t[RayPacket::SIZE], u[RayPacket::SIZE], v[RayPacket::SIZE];
+  int face[RayPacket::SIZE];
+  // Only the live lanes walk the face BVH, and only as far as the closest
+  // hit found so far; t is along the unit directions.
+  for (int k = 0; k < size; k++) {
+    t[k] = (lanes & (RayPacket::Mask(1) << k))
+               ? tMax[k] * length[k]
+               : std::numeric_limits<double>::infinity();
+  }
+  RayPacket::Mask found = mesh.faceBVH.traversePacket(
+      local, lanes, t, [&](uint32_t f, RayPacket::Mask live, double *tNear) {
+        const glm::ivec3 &ids = mesh.faces[f];
+        double tf[RayPacket::SIZE], uf[RayPacket::SIZE], vf[RayPacket::SIZE];
+        RayPacket::Mask hit = intersectTrianglePacket(
+            local.org, local.dir, size, mesh.vertex(ids[0]),
+            mesh.vertex(ids[1]), mesh.vertex(ids[2]), RAY_EPSILON, tNear,
+            live, tf, uf, vf);
+        for (int k = 0; k < size; k++) {
+          if (hit & (RayPacket::Mask(1) << k)) {
+            tNear[k] = tf[k];
+            u[k] = uf[k];
+            v[k] = vf[k];
+            face[k] = f;
+          }
+        }
+        return hit;
+      });
+
+  RayPacket::Mask closer = 0;
+  for (int k = 0; k < size; k++) {
+    if (!(found & (RayPacket::Mask(1) << k)) || !(t[k] / length[k] < tMax[k]))
+      continue;
+    isect i;
+    setFaceHit(face[k], t[k], u[k], v[k], i);
+    i.setN(glm::normalize(i.getN()));
+    i.setT(t[k] / length[k]);
+    hits[k] = i;
+    tMax[k] = i.getT();
+    closer |= RayPacket::Mask(1) << k;
+  }
+  return closer;
+}
+
+// Barycentrically interpolate the colors from the three vertices of the face
+// that was hit, and use the result as the diffuse color of a copy of the
+// mesh's material.
+void Trimesh::interpolateMaterial(const isect &i, Material &m) const {
+  const TrimeshData::VertColors &vertColors = data->vertColors;
+  const glm::ivec3 &ids = data->faces[i.getFace()];
+  glm::dvec3 bary = i.getBary();
+  glm::dvec3 c1 = bary[0] * vertColors[ids[0]];
+  glm::dvec3 c2 = bary[1] * vertColors[ids[1]];
+  glm::dvec3 c3 = bary[2] * vertColors[ids[2]];
+  glm::dvec3 new_color = glm::normalize(c1 + c2 + c3);
+  m = getMaterial();
+  m.setDiffuse(new_color);
 }
 
 // Once all the verts and faces are loaded, per vertex normals can be
 // generated by averaging the normals of the neighboring faces.
 void Trimesh::generateNormals() {
-  int cnt = vertices.size();
-  normals.resize(cnt);
+  TrimeshData &mesh = *data;
+  const TrimeshData::Faces &faces = mesh.faces;
+  int cnt = mesh.vertices.size();
+  // Summed in double, whatever the normals are stored in.
+  std::vector<glm::dvec3> normals(cnt, glm::dvec3(0, 0, 0));
+  for (int i = 0; i < std::min(cnt, (int)mesh.normals.size()); ++i)
+    normals[i] = mesh.normal(i);
   std::vector<int> numFaces(cnt, 0);
 
-  for (auto face : faces) {
-    glm::dvec3 faceNormal = face->getNormal();
+  for (size_t f = 0; f < faces.size(); ++f) {
+    glm::dvec3 faceNormal = mesh.faceNormal(f);
 
     for (int i = 0; i < 3; ++i) {
-      normals[(*face)[i]] += faceNormal;
-      ++numFaces[(*face)[i]];
+      normals[faces[f][i]] += faceNormal;
+      ++numFaces[faces[f][i]];
     }
   }
 
@@ -188,6 +305,48 @@ void Trimesh::generateNormals() {
     if (numFaces[i])
       normals[i] /= numFaces[i];
   }
+  mesh.normals.resize(cnt);
+  for (int i = 0; i < cnt; ++i)
+    mesh.normals[i] = MeshVec3(normals[i]);
 
   vertNorms = true;
 }
+
+bool TrimeshData::sameGeometry(const TrimeshData &other) const {
+  return vertices == other.vertices && faces == other.faces &&
+         normals == other.normals && vertColors == other.vertColors &&
+         uvCoords == other.uvCoords;
+}
+
+// Hash of the vertex positions and faces; the other arrays only need to be
+// compared when these already match.
+size_t TrimeshData::geometryHash() const {
+  size_t h = std::hash<size_t>()(vertices.size()) ^ (faces.size() << 1);
+  auto mix = [&h](double v) {
+    h ^= std::hash<double>()(v) + 0x9e3779b97f4a7c15ull + (h << 6) + (h >> 2);
+  };
+  for (const MeshVec3 &v : vertices) {
+    mix(v[0]);
+    mix(v[1]);
+    mix(v[2]);
+  }
+  for (const glm::ivec3 &f : faces) {
+    mix(f[0]);
+    mix(f[1]);
+    mix(f[2]);
+  }
+  return h;
+}
+
+void TrimeshCache::share(Trimesh *mesh) {
+  const TrimeshData &data = *mesh->getData();
+  size_t hash = data.geometryHash();
+  auto range = meshes.equal_range(hash);
+  for (auto it = range.first; it != range.second; ++it) {
+    if (it->second->getData()->sameGeometry(data)) {
+      mesh->shareData(*it->second);
+      return;
+    }
+  }
+  meshes.emplace(hash, mesh);
+}
@@ -3,46 +3,111 @@
 
 #include <list>
 #include <memory>
+#include <unordered_map>
 #include <vector>
 
+#include "../scene/BVH.h"
 #include "../scene/kdTree.h"
 #include "../scene/material.h"
 #include "../scene/ray.h"
 #include "../scene/scene.h"
 
 #include <glm/gtc/matrix_transform.hpp>
+#include <glm/vec2.hpp>
 #include <glm/vec3.hpp>
 
-class TrimeshFace;
-
-class Trimesh : public SceneObject {
-  friend class TrimeshFace;
-  typedef std::vector<glm::dvec3> Normals;
-  typedef std::vector<glm::dvec3> Vertices;
-  typedef std::vector<TrimeshFace *> Faces;
+// Mesh positions and normals are stored in single precision when built with
+// RAY_FLOAT_GEOMETRY, which halves the memory (and bandwidth) big meshes
+// take. They are widened back to double for all the math done on them, so
+// hits are found in double precision on the rounded geometry, the same for
+// camera and shadow rays.
+#ifdef RAY_FLOAT_GEOMETRY
+typedef glm::vec3 MeshVec3;
+#else
+typedef glm::dvec3 MeshVec3;
+#endif
+
+// The geometry of a triangle mesh. Triangles are not objects of their own:
+// a face is just an index triple into the vertex arrays plus its precomputed
+// unit normal, kept in parallel arrays. Hits are found through a BVH over the
+// faces, built in the mesh's local coordinates. Instances of the same mesh
+// share one of these (see TrimeshCache).
+struct TrimeshData {
+  typedef std::vector<MeshVec3> Normals;
+  typedef std::vector<MeshVec3> Vertices;
+  typedef std::vector<glm::ivec3> Faces;
   typedef std::vector<glm::dvec3> VertColors;
   typedef std::vector<glm::dvec2> UVCoords;
 
   Vertices vertices;
   Faces faces;
+  Normals faceNormals; // faceNormals[f]: unit normal of faces[f]
   Normals normals;
   VertColors vertColors;
   UVCoords uvCoords;
   BoundingBox localBounds;
 
+  LinearBVH faceBVH;
+  BVHBuildOptions bvhOptions; // what faceBVH was built with
+
+  glm::dvec3 vertex(int v) const { return glm::dvec3(vertices[v]); }
+  glm::dvec3 normal(int v) const { return glm::dvec3(normals[v]); }
+  glm::dvec3 faceNormal(int f) const { return glm::dvec3(faceNormals[f]); }
+
+  bool sameGeometry(const TrimeshData &other) const;
+  size_t geometryHash() const;
+};
+
+// One placement of a triangle mesh in the scene: the mesh data, which may be
+// shared with other instances, plus this instance's transform and material.
+// A mesh that is not shared has its transform baked into the vertices (so
+// its local coordinates are world coordinates); shared meshes stay in their
+// own space and rays are transformed into it instead.
+class Trimesh : public SceneObject {
+  typedef TrimeshData::Faces Faces;
+
+  std::shared_ptr<TrimeshData> data;
+  glm::dmat4 baked{1.0}; // transform already applied to the vertices
+
 public:
   Trimesh(Scene *scene, Material *mat, MatrixTransform transform)
-      : SceneObject(scene, mat), displayListWithMaterials(0),
-        displayListWithoutMaterials(0) {
+      : SceneObject(scene, mat), data(std::make_shared<TrimeshData>()),
+        displayListWithMaterials(0), displayListWithoutMaterials(0) {
     this->transform = transform;
     vertNorms = false;
   }
 
+  // Another instance of the geometry of mesh.
+  Trimesh(const Trimesh &mesh, Material *mat, MatrixTransform transform)
+      : SceneObject(mesh.getScene(), mat), data(mesh.data),
+        displayListWithMaterials(0), displayListWithoutMaterials(0) {
+    this->transform = MatrixTransform(transform.transform() *
+                                      glm::inverse(mesh.baked));
+    baked = mesh.baked;
+    vertNorms = mesh.vertNorms;
+  }
+
+  // Drop this mesh's own data in favor of other's identical data.
+  void shareData(const Trimesh &other) { data = other.data; }
+  const std::shared_ptr<TrimeshData> &getData() const { return data; }
+  bool isShared() const { return data.use_count() > 1; }
+
   bool vertNorms;
 
   bool intersectLocal(ray &r, isect &i) const;
-
-  ~Trimesh();
+  // Intersect r (in local coordinates) with a single face.
+  bool intersectFace(int face, ray &r, isect &i) const;
+  // Untransformed meshes with a face BVH trace the packet through it with
+  // the packet triangle test; anything else goes ray by ray.
+  RayPacket::Mask intersectPacket(const RayPacket &packet, ray *rays,
+                                  RayPacket::Mask lanes, double *tMax,
+                                  isect *hits) const;
+
+  // Vertex colors (without UVs) give every hit point its own diffuse color.
+  bool interpolatesMaterial() const {
+    return data->uvCoords.empty() && !data->vertColors.empty();
+  }
+  void interpolateMaterial(const isect &i, Material &m) const;
 
   // must add vertices, normals, and materials IN ORDER
   void addVertex(const glm::dvec3 &);
@@ -55,110 +120,62 @@ public:
 
   void generateNormals();
 
+  // Move the mesh into world space: transform the vertices and normals once
+  // and reset the transform to the identity, so rays reach the faces
+  // without being transformed on the way in. Does nothing for shared meshes.
+  void bakeTransform();
+  // Takes the full local-to-world transform, baked part included, so a
+  // baked mesh can still be moved like any other object.
+  void setTransform(const MatrixTransform &transform);
+  MatrixTransform getTransform() const;
+
+  // (Re)build the BVH over the faces, unless it was already built with the
+  // same options (by another instance). Until it is built, intersectLocal()
+  // tests every face.
+  void buildBVH(const BVHBuildOptions &options);
+  const BVHStats &getBVHStats() const { return data->faceBVH.getStats(); }
+
   bool hasBoundingBoxCapability() const { return true; }
 
   BoundingBox ComputeLocalBoundingBox() {
+    const TrimeshData::Vertices &vertices = data->vertices;
     BoundingBox localbounds;
     if (vertices.size() == 0)
       return localbounds;
-    localbounds.setMax(vertices[0]);
-    localbounds.setMin(vertices[0]);
-    Vertices::const_iterator viter;
+    localbounds.setMax(glm::dvec3(vertices[0]));
+    localbounds.setMin(glm::dvec3(vertices[0]));
+    TrimeshData::Vertices::const_iterator viter;
     for (viter = vertices.begin(); viter != vertices.end(); ++viter) {
-      localbounds.setMax(glm::max(localbounds.getMax(), *viter));
-      localbounds.setMin(glm::min(localbounds.getMin(), *viter));
+      localbounds.setMax(glm::max(localbounds.getMax(), glm::dvec3(*viter)));
+      localbounds.setMin(glm::min(localbounds.getMin(), glm::dvec3(*viter)));
     }
-    localBounds = localbounds;
+    data->localBounds = localbounds;
     return localbounds;
   }
 
-  auto beginFaces() const { return faces.cbegin(); }
-  auto endFaces() const { return faces.cend(); }
-  const auto &getAllFaces() const { return faces; }
+  int numFaces() const { return (int)data->faces.size(); }
+  const Faces &getAllFaces() const { return data->faces; }
 
 protected:
+  // Fill in i for a hit on face at t, with barycentric weights u and v of
+  // its second and third vertices.
+  void setFaceHit(int face, double t, double u, double v, isect &i) const;
+
   void glDrawLocal(int quality, bool actualMaterials,
                    bool actualTextures) const;
   mutable int displayListWithMaterials;
   mutable int displayListWithoutMaterials;
 };
 
-/* A triangle in a mesh. This class looks and behaves a lot like other
-SceneObjects (e.g. Trimesh, Sphere, etc.) and has many of the same members
-like intersectLocal() and a BoundingBox.
-
-However, SceneObjects must have a MatrixTransform and a Material, and storing
-these in every single TrimeshFace would explode memory usage. Because of this,
-TrimeshFace is treated as an implementation detail of Trimesh and is not within
-the SceneObject hierarchy.
-
-Access to materials and transform are provided by referencing the parent
-Trimesh object. */
-class TrimeshFace : public SceneObject {
-  Trimesh *parent;
-  int ids[3];
-  glm::dvec3 normal;
-  double dist;
-  BoundingBox bounds;
-
+// Lets a parser store identical meshes only once: each finished mesh is
+// offered to the cache, which either hands it the data of an identical mesh
+// seen before or remembers it for later ones.
+class TrimeshCache {
 public:
-  TrimeshFace(Trimesh *parent, int a, int b, int c, Scene *scene, Material *mat) : SceneObject(scene, mat) {
-    this->parent = parent;
-    this->transform = parent->transform;
-    ids[0] = a;
-    ids[1] = b;
-    ids[2] = c;
-
-    // Compute the face normal here, not on the fly
-    glm::dvec3 a_coords = parent->vertices[a];
-    glm::dvec3 b_coords = parent->vertices[b];
-    glm::dvec3 c_coords = parent->vertices[c];
-
-    glm::dvec3 vab = (b_coords - a_coords);
-    glm::dvec3 vac = (c_coords - a_coords);
-    glm::dvec3 vcb = (b_coords - c_coords);
-
-    if (glm::length(vab) == 0.0 || glm::length(vac) == 0.0 ||
-        glm::length(vcb) == 0.0)
-      degen = true;
-    else {
-      degen = false;
-      normal = glm::cross(b_coords - a_coords, c_coords - a_coords);
-      normal = glm::normalize(normal);
-      dist = glm::dot(normal, a_coords);
-    }
-    localbounds = ComputeLocalBoundingBox();
-    bounds = localbounds;
-    ComputeBoundingBox();
-  }
-
-  BoundingBox localbounds;
-  bool degen;
-
-  int operator[](int i) const { return ids[i]; }
-
-  glm::dvec3 getNormal() { return normal; }
-
-  bool intersectLocal(ray &r, isect &i) const;
-  Trimesh *getParent() const { return parent; }
-
-  bool hasBoundingBoxCapability() const { return true; }
-
-  BoundingBox ComputeLocalBoundingBox() {
-    BoundingBox localbounds;
-    localbounds.setMax(
-        glm::max(parent->vertices[ids[0]], parent->vertices[ids[1]]));
-    localbounds.setMin(
-        glm::min(parent->vertices[ids[0]], parent->vertices[ids[1]]));
-
-    localbounds.setMax(
-        glm::max(parent->vertices[ids[2]], localbounds.getMax()));
-    localbounds.setMin(
-        glm::min(parent->vertices[ids[2]], localbounds.getMin()));
-    return localbounds;
-  }
+  void share(Trimesh *mesh);
 
-  const BoundingBox &getBoundingBox() const { return localbounds; }
+private:
+  std::unordered_multimap<size_t, Trimesh *> meshes;
 };
 
 #endif // TRIMESH_H__
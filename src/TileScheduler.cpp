@@ -0,0 +1,65 @@
+#include "TileScheduler.h"
+
+#include <algorithm>
+
+void TileScheduler::reset(const Tile &region, int blockSize,
+                          unsigned int workers) {
+  blockSize = std::max(blockSize, 1);
+  workers = std::max(workers, 1u);
+
+  std::vector<Tile> tiles;
+  for (int y = region.y0; y < region.y1; y += blockSize) {
+    for (int x = region.x0; x < region.x1; x += blockSize) {
+      tiles.push_back({x, y, std::min(x + blockSize, region.x1),
+                       std::min(y + blockSize, region.y1)});
+    }
+  }
+  totalTiles = tiles.size();
+
+  queues.clear();
+  for (unsigned int k = 0; k < workers; k++)
+    queues.emplace_back(new WorkerQueue());
+
+  // Give every worker a contiguous run of tiles so neighbouring tiles (and
+  // the geometry they see) stay on the same core. Stealing takes care of
+  // the imbalance between cheap and expensive regions of the image.
+  for (unsigned int k = 0; k < workers; k++) {
+    size_t first = tiles.size() * k / workers;
+    size_t last = tiles.size() * (k + 1) / workers;
+    queues[k]->tiles.assign(tiles.begin() + first, tiles.begin() + last);
+  }
+}
+
+bool TileScheduler::popFront(WorkerQueue &q, Tile &tile) {
+  std::lock_guard<std::mutex> guard(q.lock);
+  if (q.tiles.empty())
+    return false;
+  tile = q.tiles.front();
+  q.tiles.pop_front();
+  return true;
+}
+
+bool TileScheduler::popBack(WorkerQueue &q, Tile &tile) {
+  std::lock_guard<std::mutex> guard(q.lock);
+  if (q.tiles.empty())
+    return false;
+  tile = q.tiles.back();
+  q.tiles.pop_back();
+  return true;
+}
+
+bool TileScheduler::next(unsigned int worker, Tile &tile) {
+  if (queues.empty())
+    return false;
+  worker %= queues.size();
+  if (popFront(*queues[worker], tile))
+    return true;
+
+  // Own queue is dry: steal, starting with the next worker over so that
+  // thieves spread out over the victims instead of all hitting worker 0.
+  for (size_t k = 1; k < queues.size(); k++) {
+    if (popBack(*queues[(worker + k) % queues.size()], tile))
+      return true;
+  }
+  return false;
+}
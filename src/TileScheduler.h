@@ -0,0 +1,43 @@
+#ifndef __TILESCHEDULER_H__
+#define __TILESCHEDULER_H__
+
+// Work-stealing scheduler that hands out framebuffer tiles to render workers.
+
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+// A rectangular block of pixels, [x0, x1) x [y0, y1).
+struct Tile {
+  int x0, y0;
+  int x1, y1;
+};
+
+class TileScheduler {
+public:
+  // Cut a region into blockSize x blockSize tiles (the last row and column
+  // may be smaller) and deal them out to the given number of workers.
+  void reset(const Tile &region, int blockSize, unsigned int workers);
+
+  // Fetch the next tile for a worker. A worker first drains its own queue
+  // from the front; once that is empty it steals from the back of the other
+  // workers' queues. Returns false when there is no work left anywhere.
+  bool next(unsigned int worker, Tile &tile);
+
+  size_t numTiles() const { return totalTiles; }
+
+private:
+  struct WorkerQueue {
+    std::mutex lock;
+    std::deque<Tile> tiles;
+  };
+
+  bool popFront(WorkerQueue &q, Tile &tile);
+  bool popBack(WorkerQueue &q, Tile &tile);
+
+  std::vector<std::unique_ptr<WorkerQueue>> queues;
+  size_t totalTiles = 0;
+};
+
+#endif // __TILESCHEDULER_H__
@@ -0,0 +1,73 @@
+#include "ToneMap.h"
+
+#include <algorithm>
+#include <cmath>
+
+namespace {
+
+// The sRGB curve sampled at this many linear values, plenty for 8 bits out.
+const int SRGB_STEPS = 4096;
+
+struct SRGBTable {
+  unsigned char value[SRGB_STEPS + 1];
+
+  SRGBTable() {
+    for (int k = 0; k <= SRGB_STEPS; k++) {
+      double x = (double)k / SRGB_STEPS;
+      double y = x <= 0.0031308 ? 12.92 * x
+                                : 1.055 * std::pow(x, 1.0 / 2.4) - 0.055;
+      value[k] = (unsigned char)(255.0 * y + 0.5);
+    }
+  }
+};
+
+const SRGBTable srgbTable;
+
+// The loops below are kept branch-free (min/max compile to min/max
+// instructions) so the compiler vectorizes them. The constant goes first in
+// std::max: comparisons with NaN are false, so that maps NaN to 0 where
+// std::max(x, 0.0f) would pass it on to an undefined float to int cast.
+
+void quantizeLinear(const float *in, unsigned char *out, size_t n) {
+  for (size_t k = 0; k < n; k++) {
+    float x = std::min(std::max(0.0f, in[k]), 1.0f);
+    // Truncated, as the tracer always quantized its colors.
+    out[k] = (unsigned char)(int)(255.0f * x);
+  }
+}
+
+void quantizeSRGB(const float *in, unsigned char *out, size_t n) {
+  for (size_t k = 0; k < n; k++) {
+    float x = std::min(std::max(0.0f, in[k]), 1.0f);
+    out[k] = srgbTable.value[(int)(x * SRGB_STEPS + 0.5f)];
+  }
+}
+
+} // anonymous namespace
+
+void ToneMap::quantize(Type type, const float *in, unsigned char *out,
+                       size_t n) {
+  switch (type) {
+  case SRGB:
+    quantizeSRGB(in, out, n);
+    break;
+  case LINEAR:
+  default:
+    quantizeLinear(in, out, n);
+    break;
+  }
+}
+
+bool ToneMap::typeFromName(const std::string &name, Type &type) {
+  static const struct {
+    const char *name;
+    Type type;
+  } names[] = {{"linear", LINEAR}, {"srgb", SRGB}};
+  for (const auto &entry : names) {
+    if (name == entry.name) {
+      type = entry.type;
+      return true;
+    }
+  }
+  return false;
+}
@@ -0,0 +1,26 @@
+#ifndef __TONEMAP_H__
+#define __TONEMAP_H__
+
+// Turning the linear, unbounded colors of the framebuffer into the 8-bit
+// RGB that gets drawn and saved. This happens once per frame (or per
+// refresh of the window), never while tracing.
+
+#include <cstddef>
+#include <string>
+
+class ToneMap {
+public:
+  enum Type {
+    LINEAR, // clamp to [0, 1], scale to [0, 255]
+    SRGB    // clamp, then the sRGB transfer curve
+  };
+
+  // n floats of in, each to the byte at the same place in out.
+  static void quantize(Type type, const float *in, unsigned char *out,
+                       size_t n);
+
+  // "linear" or "srgb"; false if name is neither.
+  static bool typeFromName(const std::string &name, Type &type);
+};
+
+#endif // __TONEMAP_H__
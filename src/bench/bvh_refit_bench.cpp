@@ -0,0 +1,168 @@
+// Check and benchmark for refitting the scene BVH.
+//
+// Loads a scene, then moves every object a little further in a random
+// direction a few times. After each move the scene's own tree is brought up
+// to date the way a render does it (Scene::buildBVH, which refits), and a
+// second tree is built from scratch over the moved objects. Both trees get
+// the same random rays; the report gives the time for the refit and the
+// rebuild, their SAH costs, and how many rays the two trees disagree on
+// (which should be none).
+//
+// Build with -DRAY_BUILD_BENCHMARKS=ON, then run
+//   ./bvh_refit_bench scene.ray|scene.json [moves] [rays] [refit_ratio]
+// A refit_ratio of 0 never rebuilds; a ratio just above 1 rebuilds as soon
+// as refitting makes the tree any worse, so the costs should then match.
+
+#include "../parser/JsonParser.h"
+#include "../parser/Parser.h"
+#include "../parser/Tokenizer.h"
+#include "../scene/BVH.h"
+#include "../scene/scene.h"
+#include "../ui/TraceUI.h"
+
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <vector>
+
+#include <glm/geometric.hpp>
+#include <glm/gtc/matrix_transform.hpp>
+
+// The parts of the tracer linked in here expect these from main.cpp.
+TraceUI *traceUI = nullptr;
+int TraceUI::m_threads = 1;
+
+namespace {
+
+double secondsSince(std::chrono::steady_clock::time_point start) {
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() -
+                                       start)
+      .count();
+}
+
+Scene *loadScene(const char *fn) {
+  std::ifstream ifs(fn);
+  if (!ifs) {
+    std::cerr << "couldn't read scene file " << fn << std::endl;
+    return nullptr;
+  }
+  std::string path(fn);
+  size_t slash = path.find_last_of("\\/");
+  path = slash == std::string::npos ? "." : path.substr(0, slash);
+
+  const char *ext = strrchr(fn, '.');
+  try {
+    if (ext && !strcmp(ext, ".ray")) {
+      Tokenizer tokenizer(ifs, false);
+      Parser parser(tokenizer, path);
+      return parser.parseScene();
+    }
+    JsonParser parser(path, ifs);
+    return parser.parseScene();
+  } catch (ParserException &pe) {
+    std::cerr << "couldn't parse " << fn << ": " << pe.message() << std::endl;
+  } catch (const std::exception &e) {
+    std::cerr << "couldn't parse " << fn << ": " << e.what() << std::endl;
+  }
+  return nullptr;
+}
+
+struct Ray {
+  glm::dvec3 origin, direction;
+};
+
+// Closest hits of the rays through tree; t of 0 for a miss.
+std::vector<double> traceRays(const BVH &tree, const std::vector<Ray> &rays) {
+  std::vector<double> ts;
+  ts.reserve(rays.size());
+  for (const Ray &r : rays) {
+    ray rr(r.origin, r.direction, glm::dvec3(1, 1, 1), ray::VISIBILITY);
+    isect i;
+    ts.push_back(tree.intersect(rr, i) ? i.getT() : 0.0);
+    isect::releaseScratchMaterials();
+  }
+  return ts;
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+  if (argc < 2) {
+    std::cerr << "usage: " << argv[0]
+              << " scene.ray|scene.json [moves] [rays] [refit_ratio]"
+              << std::endl;
+    return 1;
+  }
+  int numMoves = argc > 2 ? std::atoi(argv[2]) : 5;
+  size_t numRays = argc > 3 ? std::atol(argv[3]) : 100000;
+
+  std::unique_ptr<Scene> scene(loadScene(argv[1]));
+  if (!scene)
+    return 1;
+
+  BVHBuildOptions options;
+  if (argc > 4)
+    options.refitRebuildRatio = std::atof(argv[4]);
+  scene->buildBVH(options);
+
+  std::mt19937 rng(1);
+  std::uniform_real_distribution<double> unit(-1.0, 1.0);
+  auto point = [&]() { return glm::dvec3(unit(rng), unit(rng), unit(rng)); };
+
+  // Every object drifts along its own direction, 1% of the scene's size
+  // per move.
+  BoundingBox sceneBox = scene->bounds();
+  double size = glm::length(sceneBox.getMax() - sceneBox.getMin());
+  std::vector<MatrixTransform> start;
+  std::vector<glm::dvec3> drift;
+  for (Geometry *obj : scene->getAllObjects()) {
+    start.push_back(obj->getTransform());
+    drift.push_back(0.01 * size * point());
+  }
+
+  for (int move = 1; move <= numMoves; move++) {
+    for (size_t k = 0; k < start.size(); k++) {
+      glm::dmat4 offset = glm::translate(glm::dmat4(1.0), (double)move * drift[k]);
+      scene->getAllObjects()[k]->setTransform(
+          MatrixTransform(offset * start[k].transform()));
+    }
+
+    auto refitStart = std::chrono::steady_clock::now();
+    scene->buildBVH(options);
+    double refitTime = secondsSince(refitStart);
+
+    auto rebuildStart = std::chrono::steady_clock::now();
+    BVH rebuilt(scene.get(), options);
+    double rebuildTime = secondsSince(rebuildStart);
+
+    // Rays from around the scene through points inside it.
+    glm::dvec3 center = 0.5 * (sceneBox.getMin() + sceneBox.getMax());
+    std::vector<Ray> rays;
+    for (size_t k = 0; k < numRays; k++) {
+      glm::dvec3 origin = center + size * point();
+      glm::dvec3 target = center + 0.5 * size * point();
+      rays.push_back({origin, glm::normalize(target - origin)});
+    }
+    std::vector<double> refitHits = traceRays(*scene->getBVH(), rays);
+    std::vector<double> rebuiltHits = traceRays(rebuilt, rays);
+
+    size_t hits = 0, disagree = 0;
+    for (size_t k = 0; k < rays.size(); k++) {
+      hits += rebuiltHits[k] > 0.0;
+      disagree += std::fabs(refitHits[k] - rebuiltHits[k]) >
+                  1e-9 * std::max(1.0, rebuiltHits[k]);
+    }
+    std::cout << "move " << move << ": refit " << refitTime * 1000.0
+              << " ms (SAH cost " << scene->getBVH()->getStats().sahCost
+              << "), rebuild " << rebuildTime * 1000.0 << " ms (SAH cost "
+              << rebuilt.getStats().sahCost << "), " << disagree << " of "
+              << rays.size() << " rays disagree (" << hits << " hits)"
+              << std::endl;
+  }
+  return 0;
+}
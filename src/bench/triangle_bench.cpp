@@ -0,0 +1,143 @@
+// Micro-benchmark for the ray/triangle kernel.
+//
+// Shoots the same random rays at the same random triangle soup with the
+// current kernel (intersectTriangle, Moller-Trumbore) and with the plane +
+// edge cross product test it replaced, and reports the time per test and how
+// often the two disagree.
+//
+// Build with -DRAY_BUILD_BENCHMARKS=ON, then run
+//   ./triangle_bench [triangles] [rays]
+
+#include "../SceneObjects/triangle.h"
+
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <random>
+#include <vector>
+
+#include <glm/geometric.hpp>
+#include <glm/vec3.hpp>
+
+namespace {
+
+struct Triangle {
+  glm::dvec3 a, b, c;
+  glm::dvec3 normal;
+};
+
+struct Ray {
+  glm::dvec3 origin, direction;
+};
+
+// The kernel Trimesh used before: intersect the plane, then check that the
+// hit point lies on the inner side of all three edges, then compute the
+// barycentric coordinates from sub-triangle areas.
+bool legacyIntersect(const Triangle &tri, const Ray &r, double tMin, double &t,
+                     double &u, double &v) {
+  const glm::dvec3 &A = tri.a;
+  const glm::dvec3 &B = tri.b;
+  const glm::dvec3 &C = tri.c;
+  const glm::dvec3 &normal = tri.normal;
+  double t_num = glm::dot(A, normal) - glm::dot(r.origin, normal);
+  t = t_num / glm::dot(r.direction, normal);
+  if (t <= tMin)
+    return false;
+  glm::dvec3 P = r.origin + t * r.direction;
+  glm::dvec3 B_A = B - A;
+  glm::dvec3 C_B = C - B;
+  glm::dvec3 A_C = A - C;
+  glm::dvec3 C_A = C - A;
+  glm::dvec3 C_P = C - P;
+  glm::dvec3 B_P = B - P;
+  double check1 = glm::dot(normal, glm::cross(B_A, P - A));
+  double check2 = glm::dot(normal, glm::cross(C_B, P - B));
+  double check3 = glm::dot(normal, glm::cross(A_C, P - C));
+  if (!(check1 >= 0 && check2 >= 0 && check3 >= 0))
+    return false;
+  double abc = glm::dot(glm::cross(B_A, C_A), normal);
+  double pca = glm::dot(glm::cross(C_P, A_C), normal);
+  double pab = abc - glm::dot(glm::cross(B_P, C_P), normal) - pca;
+  u = pca / abc;
+  v = pab / abc;
+  return true;
+}
+
+template <typename Kernel>
+double run(const char *name, const std::vector<Triangle> &tris,
+           const std::vector<Ray> &rays, Kernel kernel,
+           std::vector<char> &hits) {
+  hits.assign(tris.size() * rays.size(), 0);
+  size_t numHits = 0;
+  double checksum = 0.0;
+  auto start = std::chrono::steady_clock::now();
+  for (size_t k = 0; k < rays.size(); k++) {
+    for (size_t j = 0; j < tris.size(); j++) {
+      double t, u, v;
+      if (kernel(tris[j], rays[k], t, u, v)) {
+        hits[k * tris.size() + j] = 1;
+        numHits++;
+        checksum += t + u + v;
+      }
+    }
+  }
+  std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - start;
+  double tests = double(tris.size()) * rays.size();
+  std::cout << name << ": " << elapsed.count() * 1e9 / tests << " ns/test, "
+            << numHits << " hits (checksum " << checksum << ")" << std::endl;
+  return elapsed.count();
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+  size_t numTris = argc > 1 ? std::atol(argv[1]) : 1000;
+  size_t numRays = argc > 2 ? std::atol(argv[2]) : 10000;
+
+  std::mt19937 rng(1);
+  std::uniform_real_distribution<double> unit(-1.0, 1.0);
+  auto point = [&]() { return glm::dvec3(unit(rng), unit(rng), unit(rng)); };
+
+  std::vector<Triangle> tris;
+  while (tris.size() < numTris) {
+    glm::dvec3 center = point();
+    Triangle tri{center + 0.2 * point(), center + 0.2 * point(),
+                 center + 0.2 * point(), glm::dvec3()};
+    glm::dvec3 n = glm::cross(tri.b - tri.a, tri.c - tri.a);
+    if (glm::length(n) == 0.0)
+      continue;
+    tri.normal = glm::normalize(n);
+    tris.push_back(tri);
+  }
+
+  std::vector<Ray> rays;
+  for (size_t k = 0; k < numRays; k++) {
+    glm::dvec3 origin = 3.0 * point();
+    glm::dvec3 target = 0.5 * point();
+    rays.push_back({origin, glm::normalize(target - origin)});
+  }
+
+  const double tMin = 1e-8;
+  std::vector<char> legacyHits, newHits;
+  double legacyTime = run(
+      "edge test     ", tris, rays,
+      [&](const Triangle &tri, const Ray &r, double &t, double &u, double &v) {
+        return legacyIntersect(tri, r, tMin, t, u, v);
+      },
+      legacyHits);
+  double newTime = run(
+      "Moller-Trumbore", tris, rays,
+      [&](const Triangle &tri, const Ray &r, double &t, double &u, double &v) {
+        return intersectTriangle(r.origin, r.direction, tri.a, tri.b, tri.c,
+                                 tMin, t, u, v);
+      },
+      newHits);
+
+  size_t disagree = 0;
+  for (size_t k = 0; k < newHits.size(); k++)
+    disagree += legacyHits[k] != newHits[k];
+  std::cout << "speedup " << legacyTime / newTime << "x, " << disagree
+            << " of " << newHits.size() << " tests disagree" << std::endl;
+  return 0;
+}
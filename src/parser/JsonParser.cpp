@@ -234,8 +234,7 @@ Trimesh *parseTrimeshBody(const json &j, ParseData &pd) {
     t->generateNormals();
   }
 
-
-
+  pd.meshCache.share(t);
   return t;
 }
 
@@ -548,6 +547,15 @@ std::vector<Trimesh *> parseObjmeshBody(const json &j, ParseData &pd) {
 
   std::vector<Trimesh *> results;
 
+  auto cached = pd.objMeshes.find(std::make_pair(path, genNormals));
+  if (cached != pd.objMeshes.end()) {
+    for (const Trimesh *mesh : cached->second) {
+      Material m = mesh->getMaterial();
+      results.push_back(new Trimesh(*mesh, &m, pd.getCurrentTransform()));
+    }
+    return results;
+  }
+
   tinyobj::ObjReaderConfig reader_config;
   reader_config.mtl_search_path = pd.scene_dir.string();
   reader_config.triangulate = true;
@@ -589,9 +597,8 @@ std::vector<Trimesh *> parseObjmeshBody(const json &j, ParseData &pd) {
       t->generateNormals();
     }
 
-
-
     results.push_back(t);
   }
+  pd.objMeshes[std::make_pair(path, genNormals)] = results;
   return results;
 }
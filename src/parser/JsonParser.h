@@ -53,6 +53,10 @@ struct ParseData {
   std::vector<glm::dmat4> transformStack;
   Scene *s;
   std::filesystem::path scene_dir;
+  // Meshes already read from each OBJ file (keyed by path and gennormals),
+  // so placing a file again only adds instances of them.
+  std::map<std::pair<std::string, bool>, std::vector<Trimesh *>> objMeshes;
+  TrimeshCache meshCache; // identical tri_meshes share their data
 
   glm::dmat4 getCurrentTransform();
 };
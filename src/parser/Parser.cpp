@@ -624,6 +624,7 @@ void Parser::parseTrimesh(Scene *scene, TransformNode *transform,
       if ((error = tmesh->doubleCheck()))
         throw ParserException(error);
 
+      meshCache.share(tmesh);
       scene->add(tmesh);
       return;
     }
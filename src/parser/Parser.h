@@ -155,6 +155,7 @@ private:
   string parseIdent();
 
   TransformRoot transformRoot;
+  TrimeshCache meshCache; // identical meshes share their data
 
 private:
   Tokenizer &_tokenizer;
@@ -1,12 +1,63 @@
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <chrono>
+#include <cmath>
+#include <exception>
 #include <glm/vec3.hpp>
+#include <limits>
+#include <memory>
+#include <system_error>
+#include <thread>
 #include <vector>
 
 #include "BVH.h"
 #include "scene.h"
 #include "../SceneObjects/trimesh.h"
 
-void BVH::buildBVH() {
-    std::vector<Geometry*> sceneObjects;
+namespace {
+double secondsSince(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+// Round a double bound to a float that still encloses it.
+float roundDown(double v) {
+    float f = (float)v;
+    return (double)f > v ? std::nextafter(f, -INFINITY) : f;
+}
+
+float roundUp(double v) {
+    float f = (float)v;
+    return (double)f < v ? std::nextafter(f, INFINITY) : f;
+}
+} // anonymous namespace
+
+// Shared state of one LinearBVH::build.
+struct BVHBuildContext {
+    const std::vector<BoundingBox> &primBounds;
+    const BVHBuildOptions &options;
+    std::vector<glm::dvec3> centers; // centers[k]: center of primBounds[k]
+    std::vector<uint32_t> indices;   // partitioned in place by the nodes
+    // Threads the build may still start. A node takes one before building a
+    // child on a new thread and gives it back when that thread is done.
+    std::atomic<int> freeThreads;
+
+    BVHBuildContext(const std::vector<BoundingBox> &primBounds, const BVHBuildOptions &options)
+        : primBounds(primBounds), options(options),
+          freeThreads(std::max(options.numThreads, 1) - 1) {}
+
+    bool takeThread() {
+        int free = freeThreads.load();
+        while (free > 0) {
+            if (freeThreads.compare_exchange_weak(free, free - 1))
+                return true;
+        }
+        return false;
+    }
+};
+
+void BVH::buildBVH(const BVHBuildOptions &options) {
+    auto start = std::chrono::steady_clock::now();
 
     // Add objects - sort beforehand??
     // Actually don't sort yet, longest axis can keep changing for each split,
@@ -16,141 +67,614 @@ void BVH::buildBVH() {
     for (auto objIter = scene->beginObjects(); objIter < scene->endObjects(); objIter++) {
         Geometry* obj = *objIter;
         if (typeid(*obj) == typeid(Trimesh)) {
-            // It's a trimesh. We treat each trimesh face as individual object.
+            // It's a trimesh. It stays a single object here and gets its own
+            // BVH over its faces, built after moving them into world space
+            // unless other instances share them (the first one builds it).
             Trimesh* trimeshObj = (Trimesh*) obj;
-            for (auto faceIter = trimeshObj->beginFaces(); faceIter < trimeshObj->endFaces(); faceIter++) {
-                // For some reason, TrimeshFace wasn't a Geometry subclass in starter code. It also never had its ComputeBoundingBox
-                // method called. So, we need to make sure to explicitly compute the bounding box for TrimeshFace. It's already automatically
-                // called by Scene::add for Trimesh and other objects.
-                // (*faceIter)->ComputeBoundingBox();
-                sceneObjects.push_back((*faceIter));
-            }
-        }
-        else {
-            // obj->ComputeBoundingBox();
-            sceneObjects.push_back(obj);
+            trimeshObj->bakeTransform();
+            trimeshObj->buildBVH(options);
         }
+        objects.push_back(obj);
     }
 
-    root = new BVHNode(sceneObjects);
+    tree.build(objectBounds(), options);
+    buildTime = secondsSince(start);
+}
 
-    // Split till leaves now. Recursive - We let the constructor do this itself.
+std::vector<BoundingBox> BVH::objectBounds() const {
+    std::vector<BoundingBox> bounds;
+    bounds.reserve(objects.size());
+    for (auto obj : objects)
+        bounds.push_back(obj->getBoundingBox());
+    return bounds;
+}
+
+bool BVH::refit() {
+    auto start = std::chrono::steady_clock::now();
+    bool rebuilt = tree.refit(objectBounds());
+    buildTime = secondsSince(start);
+    return rebuilt;
 }
 
 bool BVH::intersect(ray &r, isect &i) const {
-    isect cur;
-    bool have_one = root->intersect(r, cur);
-    i = cur;
+    bool have_one = tree.traverse(r, std::numeric_limits<double>::infinity(),
+                                  [&](uint32_t prim, double &tMax) {
+        isect cur;
+        if (objects[prim]->intersect(r, cur) && cur.getT() < tMax) {
+            i = cur;
+            tMax = cur.getT();
+            return true;
+        }
+        return false;
+    });
+
+    if (!have_one)
+        i.setT(1000.0);
+    // if debugging,
+    // if (TraceUI::m_debug) {
+    //     addToIntersectCache(std::make_pair(new ray(r), new isect(i)));
+    // }
     return have_one;
 }
 
-void BVHNode::splitNode() { // For top-down BVH construction
-    // Process to split a node:
-    // 1.Find the longest axis
-    // 2. Divide along that axis
-    // 3. Construct bounding box by merging children bounding boxes -- design choice here.
-    // Logically, we are splitting boxes here (top-down), but code efficiency wise, it is
-    // better to merge than split
+RayPacket::Mask BVH::intersectPacket(const RayPacket &packet, ray *rays, isect *hits) const {
+    double tMax[RayPacket::SIZE];
+    std::fill(tMax, tMax + packet.size, std::numeric_limits<double>::infinity());
+    RayPacket::Mask found = tree.traversePacket(packet, packet.all(), tMax,
+                                                [&](uint32_t prim, RayPacket::Mask lanes, double *tMax) {
+        return objects[prim]->intersectPacket(packet, rays, lanes, tMax, hits);
+    });
+    for (int k = 0; k < packet.size; k++) {
+        if (!(found & (RayPacket::Mask(1) << k)))
+            hits[k].setT(1000.0);
+    }
+    return found;
+}
+
+// True if an opaque object blocks the ray between tMin and tMax. Hits
+// closer than tMin are the surface the ray starts on and are ignored.
+// Transmissive objects do not stop the search; they only set 'transmissive'
+// so the caller knows the unoccluded answer still needs their attenuation.
+bool BVH::occluded(ray &r, double tMin, double tMax, bool &transmissive) const {
+    transmissive = false;
+    return tree.traverseAny(r, tMax, [&](uint32_t prim) {
+        isect cur;
+        if (!objects[prim]->intersect(r, cur) || cur.getT() < tMin || cur.getT() > tMax)
+            return false;
+        // Interpolated mesh materials only differ in the diffuse color, so
+        // the object's own material says whether the hit is transmissive.
+        if (cur.getObject()->getMaterial().Trans()) {
+            transmissive = true;
+            return false;
+        }
+        return true;
+    });
+}
+
+void LinearBVH::clear() {
+    nodes.clear();
+    nodes.shrink_to_fit();
+    wideNodes.clear();
+    wideNodes.shrink_to_fit();
+    primIndices.clear();
+    primIndices.shrink_to_fit();
+    stats = BVHStats();
+}
+
+void LinearBVH::build(const std::vector<BoundingBox> &primBounds, const BVHBuildOptions &buildOptions) {
+    auto start = std::chrono::steady_clock::now();
+    clear();
+    options = buildOptions;
+    if (primBounds.empty())
+        return;
+
+    // tree_depth is meant as a safety net, not as a way to end up with
+    // thousand-object leaves on big meshes: never go below the depth a
+    // balanced tree needs to reach maxLeafSize.
+    int leafSize = std::max(options.maxLeafSize, 1);
+    int balancedDepth = (int)std::ceil(std::log2(std::max(1.0, (double)primBounds.size() / leafSize)));
+    options.maxDepth = std::min(std::max(options.maxDepth, balancedDepth + 1), (int)MAX_DEPTH);
+
+    BVHBuildContext context(primBounds, options);
+    context.centers.reserve(primBounds.size());
+    context.indices.resize(primBounds.size());
+    for (uint32_t k = 0; k < primBounds.size(); k++) {
+        context.centers.push_back(primBounds[k].getCenter());
+        context.indices[k] = k;
+    }
+
+    // Split till leaves now. Recursive - We let the constructor do this itself.
+    // The pointer tree only lives long enough to be compacted.
+    BVHNode *root = new BVHNode(context, 0, primBounds.size(), 0);
+    nodes.reserve(2 * primBounds.size());
+    flatten(root);
+    delete root;
+
+    nodes.shrink_to_fit();
+    // Leaves point straight into the partitioned index array.
+    primIndices = std::move(context.indices);
+
+    // A single leaf gains nothing from the wide layout.
+    if (options.wide && nodes[0].count == 0) {
+        wideNodes.reserve(nodes.size() / 2);
+        collapse(0);
+        wideNodes.shrink_to_fit();
+    }
+    computeStats();
+    builtSahCost = stats.sahCost;
+    stats.buildTime = secondsSince(start);
+}
+
+bool LinearBVH::refit(const std::vector<BoundingBox> &primBounds) {
+    auto start = std::chrono::steady_clock::now();
+    if (nodes.empty() || primBounds.size() != primIndices.size()) {
+        build(primBounds, options);
+        return true;
+    }
+
+    // Children always come after their parent in the array, so walking it
+    // backwards visits every node after both of its children.
+    for (size_t index = nodes.size(); index-- > 0;) {
+        LinearBVHNode &node = nodes[index];
+        if (node.count > 0) {
+            BoundingBox box;
+            for (uint32_t k = node.offset; k < node.offset + node.count; k++)
+                box.merge(primBounds[primIndices[k]]);
+            for (int axis = 0; axis < 3; axis++) {
+                node.bmin[axis] = roundDown(box.getMin()[axis]);
+                node.bmax[axis] = roundUp(box.getMax()[axis]);
+            }
+        } else {
+            const LinearBVHNode &first = nodes[index + 1];
+            const LinearBVHNode &second = nodes[node.offset];
+            for (int axis = 0; axis < 3; axis++) {
+                node.bmin[axis] = std::min(first.bmin[axis], second.bmin[axis]);
+                node.bmax[axis] = std::max(first.bmax[axis], second.bmax[axis]);
+            }
+        }
+    }
+    computeStats();
+
+    if (options.refitRebuildRatio > 0.0 &&
+        stats.sahCost > options.refitRebuildRatio * builtSahCost) {
+        build(primBounds, options);
+        return true;
+    }
+
+    // The wide nodes copy their boxes from the binary ones, and which
+    // children got pulled up depends on their areas, so redo them as well.
+    if (!wideNodes.empty()) {
+        wideNodes.clear();
+        collapse(0);
+        stats.numWideNodes = wideNodes.size();
+    }
+    stats.buildTime = secondsSince(start);
+    return false;
+}
+
+namespace {
+double nodeArea(const LinearBVHNode &node) {
+    BoundingBox box(glm::dvec3(node.bmin[0], node.bmin[1], node.bmin[2]),
+                    glm::dvec3(node.bmax[0], node.bmax[1], node.bmax[2]));
+    return box.area();
+}
+} // anonymous namespace
+
+// Append the subtree rooted at node in depth-first order; returns the index
+// of its root in the node array.
+uint32_t LinearBVH::flatten(const BVHNode *node) {
+    uint32_t index = nodes.size();
+    nodes.emplace_back();
+
+    const BoundingBox &box = node->getBoundingBox();
+    LinearBVHNode linear;
+    for (int axis = 0; axis < 3; axis++) {
+        linear.bmin[axis] = roundDown(box.getMin()[axis]);
+        linear.bmax[axis] = roundUp(box.getMax()[axis]);
+    }
+    linear.axis = node->getAxis();
+    linear.pad = 0;
+
+    if (node->getChildren().empty()) {
+        linear.offset = node->getBegin();
+        assert(node->getEnd() - node->getBegin() <= LinearBVHNode::MAX_COUNT);
+        linear.count = node->getEnd() - node->getBegin();
+    } else {
+        linear.count = 0;
+        flatten(node->getChildren()[0]);
+        linear.offset = flatten(node->getChildren()[1]);
+    }
+    // Recursion may have reallocated the array, so store by index.
+    nodes[index] = linear;
+    return index;
+}
+
+// Build the wide node for the binary interior node at the given index (and,
+// recursively, the rest of the wide tree below it); returns its index.
+uint32_t LinearBVH::collapse(uint32_t index) {
+    // Start from the two binary children and keep opening up the interior
+    // child with the largest surface area, as it is the one most rays would
+    // descend into anyway.
+    uint32_t children[4] = { index + 1, nodes[index].offset, 0, 0 };
+    int numChildren = 2;
+    while (numChildren < 4) {
+        int best = -1;
+        double bestArea = 0.0;
+        for (int k = 0; k < numChildren; k++) {
+            const LinearBVHNode &child = nodes[children[k]];
+            if (child.count == 0 && (best < 0 || nodeArea(child) > bestArea)) {
+                best = k;
+                bestArea = nodeArea(child);
+            }
+        }
+        if (best < 0)
+            break;
+        uint32_t opened = children[best];
+        children[best] = opened + 1;
+        children[numChildren++] = nodes[opened].offset;
+    }
 
-    // Basic checks for 1 or 2 objects?
-    // TODO: should we also simplify in case of 2 objects to avoid the overhead of decisions?
-    // We wanna always simply split for 2 objects
+    uint32_t wideIndex = wideNodes.size();
+    wideNodes.emplace_back();
 
-    int numObjects = objects.size();
+    WideBVHNode wide = {};
+    wide.numChildren = numChildren;
+    for (int k = 0; k < numChildren; k++) {
+        const LinearBVHNode &child = nodes[children[k]];
+        for (int axis = 0; axis < 3; axis++) {
+            wide.bmin[axis][k] = child.bmin[axis];
+            wide.bmax[axis][k] = child.bmax[axis];
+        }
+        if (child.count > 0) {
+            wide.child[k] = child.offset;
+            wide.count[k] = child.count;
+        } else {
+            wide.child[k] = collapse(children[k]);
+            wide.count[k] = 0;
+        }
+    }
+    // Recursion may have reallocated the array, so store by index.
+    wideNodes[wideIndex] = wide;
+    return wideIndex;
+}
+
+bool LinearBVH::intersectNode(const LinearBVHNode &node, const glm::dvec3 &o,
+                              const glm::dvec3 &invDir, const int dirIsNeg[3],
+                              double &tMin, double &tMax) {
+    /*
+     * Kay/Kajiya slab test, with the divisions hoisted out into invDir and
+     * the near slab of each axis picked by the sign of the direction. An
+     * axis the ray is parallel to gives +-infinity for both slab distances,
+     * which leaves tMin/tMax alone when the origin is between the slabs and
+     * rejects the box otherwise.
+     */
+    tMin = -1.0e308;
+    tMax = 1.0e308;
+    for (int axis = 0; axis < 3; axis++) {
+        double t1 = ((dirIsNeg[axis] ? node.bmax : node.bmin)[axis] - o[axis]) * invDir[axis];
+        double t2 = ((dirIsNeg[axis] ? node.bmin : node.bmax)[axis] - o[axis]) * invDir[axis];
+        // NaNs (origin exactly on a slab of a parallel axis) fail both
+        // comparisons and so leave the interval untouched.
+        if (t1 > tMin)
+            tMin = t1;
+        if (t2 < tMax)
+            tMax = t2;
+    }
+    return tMin <= tMax && tMax >= RAY_EPSILON;
+}
+
+RayPacket::Mask LinearBVH::intersectNodePacket(const LinearBVHNode &node, const RayPacket &packet,
+                                               const double tMax[], RayPacket::Mask lanes) {
+    if (packet.coherent) {
+        /*
+         * Interval arithmetic: with every direction component of one sign,
+         * each slab distance is monotone in the origin and the inverse
+         * direction, so the corners of their ranges bound it for all lanes
+         * at once. If even the most favourable lane misses, all do.
+         */
+        double tNear = -1.0e308;
+        double tFar = 1.0e308;
+        for (int axis = 0; axis < 3; axis++) {
+            double nearSlab = packet.dirIsNeg[axis] ? node.bmax[axis] : node.bmin[axis];
+            double farSlab = packet.dirIsNeg[axis] ? node.bmin[axis] : node.bmax[axis];
+            double n[4] = { (nearSlab - packet.orgMin[axis]) * packet.invMin[axis],
+                            (nearSlab - packet.orgMin[axis]) * packet.invMax[axis],
+                            (nearSlab - packet.orgMax[axis]) * packet.invMin[axis],
+                            (nearSlab - packet.orgMax[axis]) * packet.invMax[axis] };
+            double f[4] = { (farSlab - packet.orgMin[axis]) * packet.invMin[axis],
+                            (farSlab - packet.orgMin[axis]) * packet.invMax[axis],
+                            (farSlab - packet.orgMax[axis]) * packet.invMin[axis],
+                            (farSlab - packet.orgMax[axis]) * packet.invMax[axis] };
+            tNear = std::max(tNear, *std::min_element(n, n + 4));
+            tFar = std::min(tFar, *std::max_element(f, f + 4));
+        }
+        double maxT = 0.0;
+        for (int k = 0; k < packet.size; k++) {
+            if (lanes & (RayPacket::Mask(1) << k))
+                maxT = std::max(maxT, tMax[k]);
+        }
+        if (tNear > tFar || tFar < RAY_EPSILON || tNear > maxT)
+            return 0;
+    }
+
+    /*
+     * Same as intersectNode(), lane by lane, up to the first lane that hits.
+     * That lane and every active one after it go down together: the lanes
+     * that actually miss the box only cost extra tests further down, which
+     * reject them anyway, and in a coherent packet that is cheaper than
+     * testing each of them here.
+     */
+    for (int k = 0; k < packet.size; k++) {
+        if (!(lanes & (RayPacket::Mask(1) << k)))
+            continue;
+        double tMin = -1.0e308;
+        double tFar = 1.0e308;
+        for (int axis = 0; axis < 3; axis++) {
+            double t1 = (node.bmin[axis] - packet.org[axis][k]) * packet.invDir[axis][k];
+            double t2 = (node.bmax[axis] - packet.org[axis][k]) * packet.invDir[axis][k];
+            double tEnter = t1 > t2 ? t2 : t1;
+            double tExit = t1 > t2 ? t1 : t2;
+            tMin = tEnter > tMin ? tEnter : tMin;
+            tFar = tExit < tFar ? tExit : tFar;
+        }
+        if (tMin <= tFar && tFar >= RAY_EPSILON && tMin <= tMax[k])
+            return lanes & ~((RayPacket::Mask(1) << k) - 1);
+    }
+    return 0;
+}
 
-    if (numObjects == 0) {
-        this->boundingBox = BoundingBox();
+// Walk the finished tree and fill in the build-quality report. The SAH cost
+// is the expected cost of tracing a ray that hits the root box:
+//   sum over interior nodes of traversalCost * area(node) / area(root)
+// + sum over leaves of leafCost * objects(leaf) * area(leaf) / area(root)
+void LinearBVH::computeStats() {
+    stats = BVHStats();
+    if (nodes.empty())
         return;
+
+    double rootArea = nodeArea(nodes[0]);
+    stats.numWideNodes = wideNodes.size();
+
+    std::vector<std::pair<uint32_t, int>> todo;
+    todo.push_back(std::make_pair(0, 0));
+    while (!todo.empty()) {
+        const LinearBVHNode &node = nodes[todo.back().first];
+        int depth = todo.back().second;
+        todo.pop_back();
+
+        double areaRatio = rootArea > 0.0 ? nodeArea(node) / rootArea : 1.0;
+
+        stats.numNodes++;
+        stats.depth = std::max(stats.depth, depth);
+        if (node.count > 0) {
+            size_t n = node.count;
+            stats.numLeaves++;
+            stats.numObjects += n;
+            if (stats.leafHistogram.size() <= n)
+                stats.leafHistogram.resize(n + 1, 0);
+            stats.leafHistogram[n]++;
+            stats.sahCost += options.leafCost * n * areaRatio;
+        } else {
+            stats.sahCost += options.traversalCost * areaRatio;
+            uint32_t index = &node - nodes.data();
+            todo.push_back(std::make_pair(index + 1, depth + 1));
+            todo.push_back(std::make_pair(node.offset, depth + 1));
+        }
+    }
+}
+
+void BVHStats::print(std::ostream &out) const {
+    out << "BVH: " << numObjects << " objects, " << numNodes << " nodes, "
+        << numLeaves << " leaves, depth " << depth << ", SAH cost " << sahCost
+        << ", built in " << buildTime * 1000.0 << " ms" << std::endl;
+    if (numWideNodes > 0) {
+        out << "  4-wide: " << numWideNodes << " nodes, "
+            << LinearBVH::wideNodeTestName << " box tests" << std::endl;
+    }
+    out << "  leaf sizes:";
+    for (size_t k = 0; k < leafHistogram.size(); k++) {
+        if (leafHistogram[k])
+            out << " " << k << ":" << leafHistogram[k];
+    }
+    out << std::endl;
+}
+
+void BVHNode::splitNode() { // For top-down BVH construction
+    // Process to split a node:
+    // 1. Bound the objects and their centers
+    // 2. Pick the axis along which the centers are spread out the most
+    // 3. Divide along that axis, either at the object median or where the
+    //    surface area heuristic says it is cheapest
+    // 4. Recurse; the children are built by their constructors
+
+    const BVHBuildOptions &options = context.options;
+    int numObjects = end - begin;
+
+    // 1. Bound the objects and their centers. We approximate each object's
+    // center by the center of its bounding box.
+    this->boundingBox = BoundingBox();
+    BoundingBox centroidBounds;
+    for (uint32_t k = begin; k < end; k++) {
+        uint32_t object = context.indices[k];
+        (this->boundingBox).merge(context.primBounds[object]);
+        const glm::dvec3 &center = context.centers[object];
+        centroidBounds.merge(BoundingBox(center, center));
     }
 
-    if (numObjects == 1) {
-        this->boundingBox = BoundingBox();
-        (this->boundingBox).merge(objects[0]->getBoundingBox());
+    // A flattened leaf counts its objects in 16 bits, so whatever the depth
+    // limit, the leaf size limit or the SAH say, we still split (at the
+    // median if need be) anything that would not fit.
+    bool overfull = numObjects > (int)LinearBVHNode::MAX_COUNT;
+    if (numObjects <= 1 || (depth >= options.maxDepth && !overfull)) {
         return;
     }
 
-    // 1.Find the longest axis
-    glm::dvec3 boxMax = boundingBox.getMax();
-    glm::dvec3 boxMin = boundingBox.getMin();
-    glm::dvec3 axisLengths = boxMax - boxMin;
+    // 2. Find the longest axis of the centers' extent. All centers on one
+    // point means there is nothing to split spatially; we only keep going
+    // (by object count) if the node is too big to be a leaf.
+    glm::dvec3 axisLengths = centroidBounds.getMax() - centroidBounds.getMin();
 
-    int argMax = 0, max = axisLengths[0];
+    int argMax = 0;
+    double max = axisLengths[0];
     for (int i=1; i<3; i++) {
         if (axisLengths[i] > max) {
             max = axisLengths[i];
             argMax = i;
         }
     }
+    if (max <= 0.0 && numObjects <= options.maxLeafSize && !overfull) {
+        return;
+    }
+    this->axis = argMax;
 
-    // 2. Divide along the axis - need to decide how to divide 
-    // TODO: Currently does simple equal object division, see if can include SAH logic here
+    // 3. Divide along the axis, reordering our range of the index array so
+    // the first child's objects come before middle.
+    uint32_t middle;
+    bool split;
+    if (options.method == BVHBuildOptions::SAH && max > 0.0 && depth < options.maxDepth) {
+        split = splitSAH(argMax, centroidBounds, middle);
+    } else {
+        split = splitMedian(argMax, middle);
+    }
+    if (!split && overfull)
+        split = splitMedian(argMax, middle);
+    if (!split) {
+        return;
+    }
 
-    // We need to find the correct middle object to split across.
-    // We sort by object centers, which we approximate by bounding box center.
+    // 4. Build the children. If this node is big enough to be worth it and a
+    // thread is free, the first child is built on it while this thread does
+    // the second. Each child only touches its own half of the index array.
+    // Whatever either side throws (bad_alloc, say), the worker is joined
+    // before it leaves this scope, and its own exception is passed on here.
+    std::unique_ptr<BVHNode> first, second;
+    std::exception_ptr workerError;
+    {
+        std::thread worker;
+        struct Joiner {
+            std::thread &thread;
+            ~Joiner() {
+                if (thread.joinable())
+                    thread.join();
+            }
+        } joiner{ worker };
+        bool parallel = numObjects >= options.parallelMinObjects && context.takeThread();
+        if (parallel) {
+            try {
+                worker = std::thread([&]() {
+                    try {
+                        first.reset(new BVHNode(context, begin, middle, depth + 1));
+                    } catch (...) {
+                        workerError = std::current_exception();
+                    }
+                    context.freeThreads++;
+                });
+            } catch (const std::system_error &) {
+                // No thread after all; build it here.
+                context.freeThreads++;
+                parallel = false;
+            }
+        }
+        if (!parallel)
+            first.reset(new BVHNode(context, begin, middle, depth + 1));
+        second.reset(new BVHNode(context, middle, end, depth + 1));
+    }
+    if (workerError)
+        std::rethrow_exception(workerError);
 
+    children.reserve(2);
+    children.push_back(first.release());
+    children.push_back(second.release());
+}
 
-    std::nth_element(objects.begin(), objects.begin() + numObjects/2 , objects.end(),
-                        [argMax](Geometry *a, Geometry *b) {
-                            return a->getBoundingBox().getCenter()[argMax] < b->getBoundingBox().getCenter()[argMax];
+// Equal object division: split at the median of the object centers.
+bool BVHNode::splitMedian(int axis, uint32_t &middle) {
+    auto objects = context.indices.begin();
+    const std::vector<glm::dvec3> &centers = context.centers;
+    middle = begin + (end - begin) / 2;
+    std::nth_element(objects + begin, objects + middle, objects + end,
+                        [&](uint32_t a, uint32_t b) {
+                            return centers[a][axis] < centers[b][axis];
                             }
                         );
 
-    // Now, the center of bounding box for object at index numObjects/2 is greater than the centers of all bounding box of objects
-    // to its left in the list. (and same for the other direction) in its value on the argMax axis.
+    // Now, the center of bounding box for object at index middle is greater than the centers of all bounding box of objects
+    // to its left in the list. (and same for the other direction) in its value on the axis.
+    return true;
+}
 
-    std::vector<Geometry*> firstHalfObjects(objects.begin(), objects.begin() + numObjects/2);
-    std::vector<Geometry*> secondHalfObjects(objects.begin() + numObjects/2, objects.end());
-    BVHNode *first = new BVHNode(firstHalfObjects);
-    BVHNode *second = new BVHNode(secondHalfObjects);
+// Binned SAH: drop the object centers into numBins buckets along the axis,
+// then sweep the bucket boundaries and pick the one minimizing
+//   traversalCost + leafCost * (nL * area(L) + nR * area(R)) / area(node)
+// Returns false if keeping the node as a leaf is cheaper (and allowed).
+bool BVHNode::splitSAH(int axis, const BoundingBox &centroidBounds, uint32_t &middle) {
+    const BVHBuildOptions &options = context.options;
+    auto objects = context.indices.begin();
+    int numObjects = end - begin;
+    int numBins = std::max(options.numBins, 2);
+    double cmin = centroidBounds.getMin()[axis];
+    double extent = centroidBounds.getMax()[axis] - cmin;
 
-    children.push_back(first);
-    children.push_back(second);
+    auto binOf = [&](uint32_t object) {
+        double c = context.centers[object][axis];
+        int b = (int)(numBins * ((c - cmin) / extent));
+        return std::min(std::max(b, 0), numBins - 1);
+    };
 
-    // 3. Construct bounding box by merging children bounding boxes
-    this->boundingBox = BoundingBox();
-    (this->boundingBox).merge(first->getBoundingBox());
-    (this->boundingBox).merge(second->getBoundingBox());
-
-    return;
-}
-
-bool BVHNode::intersect(ray &r, isect &i) const {
-    double tmin = 0.0;
-    double tmax = 0.0;
-    bool have_one = false;
-
-    bool intersect = boundingBox.intersect(r, tmin, tmax);
-    if (intersect) {
-        if (children.empty()) {
-            // We are at the leaf node. Do actual object intersection here
-            for (const auto &obj : objects) {
-                isect cur;
-                if (obj->intersect(r, cur)) {
-                    if (!have_one || (cur.getT() < i.getT())) {
-                        i = cur;
-                        have_one = true;
-                    }
-                }
-            }
+    std::vector<BoundingBox> binBounds(numBins);
+    std::vector<int> binCounts(numBins, 0);
+    for (uint32_t k = begin; k < end; k++) {
+        uint32_t object = objects[k];
+        int b = binOf(object);
+        binCounts[b]++;
+        binBounds[b].merge(context.primBounds[object]);
+    }
+
+    // Sweep from the right to get the area/count of every right-hand side,
+    // then from the left to evaluate each candidate split.
+    std::vector<double> rightArea(numBins, 0.0);
+    std::vector<int> rightCount(numBins, 0);
+    BoundingBox acc;
+    int count = 0;
+    for (int b = numBins - 1; b > 0; b--) {
+        acc.merge(binBounds[b]);
+        count += binCounts[b];
+        rightArea[b] = acc.area();
+        rightCount[b] = count;
+    }
+
+    double nodeArea = BoundingBox(boundingBox).area();
+    int bestSplit = -1;
+    double bestCost = 0.0;
+    acc = BoundingBox();
+    count = 0;
+    for (int b = 0; b < numBins - 1; b++) {
+        acc.merge(binBounds[b]);
+        count += binCounts[b];
+        if (count == 0 || rightCount[b + 1] == 0)
+            continue;
+        double cost = count * acc.area() + rightCount[b + 1] * rightArea[b + 1];
+        if (bestSplit < 0 || cost < bestCost) {
+            bestCost = cost;
+            bestSplit = b;
         }
-        else {
-            for (const auto &child: children) {
-                isect cur;
-                if (child->intersect(r, cur)) {
-                    if (!have_one || (cur.getT() < i.getT())) {
-                        i = cur;
-                        have_one = true;
-                    }
-                }
-            }
+    }
+
+    if (bestSplit < 0) {
+        // Every center landed in a single bucket; fall back to the median.
+        return splitMedian(axis, middle);
+    }
+
+    if (nodeArea > 0.0) {
+        bestCost = options.traversalCost + options.leafCost * bestCost / nodeArea;
+        double leafCost = options.leafCost * numObjects;
+        if (numObjects <= options.maxLeafSize && leafCost <= bestCost) {
+            return false;
         }
     }
 
-    if (!have_one)
-        i.setT(1000.0);
-    // if debugging,
-    // if (TraceUI::m_debug) {
-    //     addToIntersectCache(std::make_pair(new ray(r), new isect(i)));
-    // }
-    return have_one;
-}
\ No newline at end of file
+    middle = std::partition(objects + begin, objects + end,
+                            [&](uint32_t object) { return binOf(object) <= bestSplit; })
+             - objects;
+    return true;
+}
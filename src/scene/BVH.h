@@ -1,58 +1,507 @@
 #pragma once
 
+#include <cstdint>
+#include <ostream>
 #include <vector>
 
+#include "RayPacket.h"
+#include "RayStats.h"
 #include "bbox.h"
 #include "scene.h"
 
+// Knobs for the top-down BVH build.
+struct BVHBuildOptions {
+    enum SplitMethod { MEDIAN, SAH };
+
+    SplitMethod method = SAH;
+    // Number of buckets the centroid range is cut into when evaluating SAH
+    // splits along the chosen axis.
+    int numBins = 16;
+    // Cost of visiting an interior node (one box test) and of testing one
+    // primitive in a leaf, in the same arbitrary units.
+    double traversalCost = 1.0;
+    double leafCost = 1.0;
+    // Nodes with at most maxLeafSize objects may become leaves when the SAH
+    // says splitting does not pay off; bigger nodes are always split.
+    int maxLeafSize = 4;
+    // Hard limit on tree depth (TraceUI's tree_depth). It is raised when it
+    // would force leaves far above maxLeafSize for the scene at hand, and
+    // capped so the traversal stack cannot overflow.
+    int maxDepth = 32;
+    // Also build the 4-wide layout and traverse that instead of the binary
+    // tree.
+    bool wide = true;
+    // Threads the build may use; subtrees of at least parallelMinObjects
+    // objects are built on another thread when one is free.
+    int numThreads = 1;
+    int parallelMinObjects = 4096;
+    // A refit keeps the tree only while its SAH cost stays below
+    // refitRebuildRatio times the cost it had when it was built; past that,
+    // it is rebuilt from scratch. 0 never rebuilds.
+    double refitRebuildRatio = 1.5;
+
+    // True if both would build the same tree (thread settings aside).
+    bool sameTree(const BVHBuildOptions &other) const {
+        return method == other.method && numBins == other.numBins &&
+               traversalCost == other.traversalCost && leafCost == other.leafCost &&
+               maxLeafSize == other.maxLeafSize && maxDepth == other.maxDepth &&
+               wide == other.wide && refitRebuildRatio == other.refitRebuildRatio;
+    }
+};
+
+// Build-quality report, used to compare split methods.
+struct BVHStats {
+    double sahCost = 0.0; // expected cost of a random ray, see computeStats()
+    int depth = 0;
+    int numNodes = 0;
+    int numLeaves = 0;
+    int numObjects = 0;
+    std::vector<int> leafHistogram; // leafHistogram[k]: leaves holding k objects
+    int numWideNodes = 0; // 0 unless the 4-wide layout was built
+    double buildTime = 0.0; // seconds
+
+    void print(std::ostream &out) const;
+};
+
+// One node of the flattened tree. Nodes are stored in depth-first order, so
+// the first child of an interior node is the node right after it and only
+// the second child needs an explicit index. Bounds are floats, rounded
+// outwards, which keeps a node at 32 bytes (two per cache line).
+struct LinearBVHNode {
+    float bmin[3];
+    float bmax[3];
+    // Interior node: index of the second child.
+    // Leaf: index of the first entry in the primitive index array.
+    uint32_t offset;
+    uint16_t count; // primitives in a leaf, 0 for interior nodes
+    uint8_t axis;   // split axis of an interior node
+    uint8_t pad;
+
+    // The most primitives count can hold; the build splits bigger leaves.
+    static const uint32_t MAX_COUNT = 0xFFFF;
+};
+static_assert(sizeof(LinearBVHNode) == 32, "LinearBVHNode should fill half a cache line");
+
+// One node of the 4-wide tree, made by collapsing the binary one: a node
+// takes over the children of its binary children until it has four. The
+// child boxes are stored per axis, so all four are tested at once.
+struct alignas(32) WideBVHNode {
+    float bmin[3][4]; // bmin[axis][child]
+    float bmax[3][4];
+    // Interior child: index of its node. Leaf child: index of its first entry
+    // in the primitive index array.
+    uint32_t child[4];
+    uint16_t count[4]; // primitives in a leaf child, 0 for an interior child
+    uint8_t numChildren;
+    uint8_t pad[7];
+};
+static_assert(sizeof(WideBVHNode) == 128, "WideBVHNode should fill two cache lines");
+
+// Slab test of a ray against the (up to) four child boxes of a wide node.
+// Returns a bit mask of the children hit closer than tMax and stores their
+// entry distances in tNear. The implementation is picked at startup from
+// what the CPU supports (AVX, SSE2 or plain C++); all give the same answers
+// as LinearBVH::intersectNode.
+typedef int (*WideNodeTest)(const WideBVHNode &node, const double o[3],
+                            const double invDir[3], double tMax, double tNear[4]);
+
+struct BVHBuildContext;
+
+// Build-time node. The tree is built top-down from these and then compacted
+// into a LinearBVH; none of them survive the build. All nodes share a single
+// array of primitive indices: a node owns the range [begin, end) of it and
+// splits by partitioning that range in place, so its children own the two
+// halves. Big subtrees are handed to other threads.
 class BVHNode {
     private:
         BoundingBox boundingBox;
-        // bool boundsInitialized;
-        std::vector<Geometry*> objects;
         std::vector<BVHNode*> children;
+        int axis;
+
+        BVHBuildContext &context;
+        uint32_t begin;
+        uint32_t end;
+        int depth;
+
+        bool splitMedian(int axis, uint32_t &middle);
+        bool splitSAH(int axis, const BoundingBox &centroidBounds, uint32_t &middle);
 
     public:
-        BVHNode(std::vector<Geometry*> objects) {
-            // this->boundingBox = bBox;
-            // this->boundsInitialized = false;
+        BVHNode(BVHBuildContext &context, uint32_t begin, uint32_t end, int depth)
+            : axis(0), context(context), begin(begin), end(end), depth(depth) {
             // SplitNode also populates the boundingBox
-            this->objects = objects;
             splitNode();
         }
 
-        auto getChildren() {
+        ~BVHNode() {
+            for (auto child : children)
+                delete child;
+        }
+
+        const std::vector<BVHNode*> &getChildren() const {
             return this->children;
         }
 
-        auto getBoundingBox() {
-            // TODO: Should we move this to cpp instead?
-            // if (!boundsInitialized) {
-            //     this->boundingBox = BoundingBox();
-            //     for (auto object : this->objects) {
-            //         this->boundingBox.merge(object->getBoundingBox());
-            //     }
-            //     boundsInitialized = true;
-            // }
+        const BoundingBox &getBoundingBox() const {
             return this->boundingBox;
         }
 
-        bool intersect(ray &r, isect &i) const;
+        // Range of the shared index array holding the objects of a leaf.
+        uint32_t getBegin() const { return begin; }
+        uint32_t getEnd() const { return end; }
+        int getAxis() const { return axis; }
+
         void splitNode();
 };
 
+// A BVH over an arbitrary set of primitives, known to it only by their
+// bounding boxes. Leaves refer to primitives by their index in the array the
+// tree was built from; the caller does the actual primitive tests.
+class LinearBVH {
+    private:
+        std::vector<LinearBVHNode> nodes;
+        std::vector<WideBVHNode> wideNodes;
+        std::vector<uint32_t> primIndices;
+        BVHBuildOptions options;
+        BVHStats stats;
+        double builtSahCost = 0.0; // stats.sahCost right after the last build
+
+        uint32_t flatten(const BVHNode *node);
+        uint32_t collapse(uint32_t node);
+        void computeStats();
+
+        template <typename LeafTest>
+        bool traverseWide(const ray &r, double tMax, LeafTest leafTest) const;
+        template <typename LeafTest>
+        bool traverseWideAny(const ray &r, double tMax, LeafTest leafTest) const;
+
+    public:
+        static const int MAX_DEPTH = 48;
+        static const int STACK_SIZE = 64;
+        // A wide node can leave three siblings on the stack per level. Splits
+        // of overfull leaves may take the tree up to STACK_SIZE levels.
+        static const int WIDE_STACK_SIZE = 3 * STACK_SIZE + 1;
+
+        static const WideNodeTest wideNodeTest;
+        static const char *const wideNodeTestName;
+
+        void build(const std::vector<BoundingBox> &primBounds, const BVHBuildOptions &options);
+        // Update the node bounds for primitives that moved, keeping the
+        // tree's structure; primBounds must hold the same primitives, in the
+        // same order, as the last build. Rebuilds instead if the refitted
+        // tree got too much worse (see refitRebuildRatio). Returns true if
+        // it rebuilt.
+        bool refit(const std::vector<BoundingBox> &primBounds);
+        void clear();
+
+        bool empty() const { return nodes.empty(); }
+        const BVHStats &getStats() const { return stats; }
+        const std::vector<LinearBVHNode> &getNodes() const { return nodes; }
+        const std::vector<WideBVHNode> &getWideNodes() const { return wideNodes; }
+        const std::vector<uint32_t> &getPrimIndices() const { return primIndices; }
+
+        // Slab test of the ray (origin o, inverse direction invDir, with the
+        // sign bits of the direction in dirIsNeg) against a node. Same
+        // contract as BoundingBox::intersect.
+        static bool intersectNode(const LinearBVHNode &node, const glm::dvec3 &o,
+                                  const glm::dvec3 &invDir, const int dirIsNeg[3],
+                                  double &tMin, double &tMax);
+
+        // Visit the leaves whose box the ray hits closer than tMax, front to
+        // back, calling leafTest(prim, tMax) for each primitive in them. When
+        // leafTest finds a hit it lowers tMax to the hit distance and returns
+        // true; nodes entered beyond tMax are skipped from then on.
+        template <typename LeafTest>
+        bool traverse(const ray &r, double tMax, LeafTest leafTest) const;
+
+        // Any-hit variant for shadow rays: visits the leaves closer than tMax
+        // in no particular order and stops at the first primitive for which
+        // leafTest(prim) returns true.
+        template <typename LeafTest>
+        bool traverseAny(const ray &r, double tMax, LeafTest leafTest) const;
+
+        // Slab test of the given lanes of a packet against a node. Returns
+        // the lanes from the first one that hits it closer than its tMax on
+        // (none if no lane does), a superset of the lanes that hit. Coherent
+        // packets are first tested as a whole, which rejects most missed
+        // nodes at once.
+        static RayPacket::Mask intersectNodePacket(const LinearBVHNode &node,
+                                                   const RayPacket &packet,
+                                                   const double tMax[],
+                                                   RayPacket::Mask lanes);
+
+        // Packet version of traverse(), over the binary nodes, for the given
+        // lanes. A node is entered by the lanes that hit it, in the order
+        // the packet as a whole runs along its split axis. leafTest(prim,
+        // lanes, tMax) tests the lanes that reached a leaf, lowers tMax[k]
+        // for the lanes it finds closer hits for and returns those lanes.
+        // Returns the lanes that hit anything.
+        template <typename LeafTest>
+        RayPacket::Mask traversePacket(const RayPacket &packet, RayPacket::Mask lanes,
+                                       double tMax[], LeafTest leafTest) const;
+};
+
+template <typename LeafTest>
+RayPacket::Mask LinearBVH::traversePacket(const RayPacket &packet, RayPacket::Mask lanes,
+                                          double tMax[], LeafTest leafTest) const {
+    if (nodes.empty() || !lanes)
+        return 0;
+
+    struct Entry {
+        uint32_t node;
+        RayPacket::Mask lanes; // lanes that hit the parent
+    };
+    RayPacket::Mask have_one = 0;
+    uint64_t boxTests = 0, primTests = 0;
+    Entry stack[STACK_SIZE];
+    int stackSize = 0;
+    Entry current = { 0, lanes };
+    for (;;) {
+        const LinearBVHNode &node = nodes[current.node];
+        lanes = intersectNodePacket(node, packet, tMax, current.lanes);
+        boxTests++;
+        if (lanes) {
+            if (node.count > 0) {
+                primTests += node.count;
+                for (uint32_t k = node.offset; k < node.offset + node.count; k++)
+                    have_one |= leafTest(primIndices[k], lanes, tMax);
+            } else if (packet.dirIsNeg[node.axis]) {
+                stack[stackSize++] = { current.node + 1, lanes };
+                current = { node.offset, lanes };
+                continue;
+            } else {
+                stack[stackSize++] = { node.offset, lanes };
+                current = { current.node + 1, lanes };
+                continue;
+            }
+        }
+        if (stackSize == 0)
+            break;
+        current = stack[--stackSize];
+    }
+    RayStats::countTests(boxTests, primTests);
+    return have_one;
+}
+
+template <typename LeafTest>
+bool LinearBVH::traverse(const ray &r, double tMax, LeafTest leafTest) const {
+    if (nodes.empty())
+        return false;
+    if (!wideNodes.empty())
+        return traverseWide(r, tMax, leafTest);
+
+    const glm::dvec3 o = r.getPosition();
+    const glm::dvec3 &invDir = r.getInverseDirection();
+    const int dirIsNeg[3] = { r.getDirSign(0), r.getDirSign(1), r.getDirSign(2) };
+
+    bool have_one = false;
+    uint64_t boxTests = 0, primTests = 0;
+    uint32_t stack[STACK_SIZE];
+    int stackSize = 0;
+    uint32_t current = 0;
+    for (;;) {
+        const LinearBVHNode &node = nodes[current];
+        double tNear, tFar;
+        boxTests++;
+        if (intersectNode(node, o, invDir, dirIsNeg, tNear, tFar) && tNear <= tMax) {
+            if (node.count > 0) {
+                // We are at the leaf node. Do actual object intersection here
+                primTests += node.count;
+                for (uint32_t k = node.offset; k < node.offset + node.count; k++) {
+                    if (leafTest(primIndices[k], tMax))
+                        have_one = true;
+                }
+            } else if (dirIsNeg[node.axis]) {
+                // Ray runs against the split axis: the second child is nearer.
+                stack[stackSize++] = current + 1;
+                current = node.offset;
+                continue;
+            } else {
+                // First child is next in memory, come back for the second.
+                stack[stackSize++] = node.offset;
+                current++;
+                continue;
+            }
+        }
+        if (stackSize == 0)
+            break;
+        current = stack[--stackSize];
+    }
+    RayStats::countTests(boxTests, primTests);
+    return have_one;
+}
+
+template <typename LeafTest>
+bool LinearBVH::traverseAny(const ray &r, double tMax, LeafTest leafTest) const {
+    if (nodes.empty())
+        return false;
+    if (!wideNodes.empty())
+        return traverseWideAny(r, tMax, leafTest);
+
+    const glm::dvec3 o = r.getPosition();
+    const glm::dvec3 &invDir = r.getInverseDirection();
+    const int dirIsNeg[3] = { r.getDirSign(0), r.getDirSign(1), r.getDirSign(2) };
+
+    uint64_t boxTests = 0, primTests = 0;
+    uint32_t stack[STACK_SIZE];
+    int stackSize = 0;
+    uint32_t current = 0;
+    for (;;) {
+        const LinearBVHNode &node = nodes[current];
+        double tNear, tFar;
+        boxTests++;
+        if (intersectNode(node, o, invDir, dirIsNeg, tNear, tFar) && tNear <= tMax) {
+            if (node.count > 0) {
+                for (uint32_t k = node.offset; k < node.offset + node.count; k++) {
+                    primTests++;
+                    if (leafTest(primIndices[k])) {
+                        RayStats::countTests(boxTests, primTests);
+                        return true;
+                    }
+                }
+            } else {
+                stack[stackSize++] = node.offset;
+                current++;
+                continue;
+            }
+        }
+        if (stackSize == 0)
+            break;
+        current = stack[--stackSize];
+    }
+    RayStats::countTests(boxTests, primTests);
+    return false;
+}
+
+template <typename LeafTest>
+bool LinearBVH::traverseWide(const ray &r, double tMax, LeafTest leafTest) const {
+    const glm::dvec3 &inv = r.getInverseDirection();
+    const double o[3] = { r.getPosition()[0], r.getPosition()[1], r.getPosition()[2] };
+    const double invDir[3] = { inv[0], inv[1], inv[2] };
+
+    // Entries remember how far away their box starts, so anything a closer
+    // hit has made irrelevant is dropped without another box test.
+    struct Entry {
+        uint32_t node;
+        double tNear;
+    };
+    Entry stack[WIDE_STACK_SIZE];
+    int stackSize = 0;
+    stack[stackSize++] = { 0, 0.0 };
+
+    bool have_one = false;
+    uint64_t boxTests = 0, primTests = 0;
+    while (stackSize > 0) {
+        Entry entry = stack[--stackSize];
+        if (entry.tNear > tMax)
+            continue;
+        const WideBVHNode &node = wideNodes[entry.node];
+        double tNear[4];
+        int mask = wideNodeTest(node, o, invDir, tMax, tNear);
+        boxTests += node.numChildren;
+
+        // Sort the children that were hit near to far.
+        int order[4];
+        int numHit = 0;
+        for (int k = 0; k < node.numChildren; k++) {
+            if (!(mask & (1 << k)))
+                continue;
+            int j = numHit++;
+            for (; j > 0 && tNear[order[j - 1]] > tNear[k]; j--)
+                order[j] = order[j - 1];
+            order[j] = k;
+        }
+
+        // Leaves are tested right away, nearest first, so their hits can
+        // cull the interior children; those are pushed far to near.
+        for (int j = 0; j < numHit; j++) {
+            int k = order[j];
+            if (node.count[k] == 0 || tNear[k] > tMax)
+                continue;
+            primTests += node.count[k];
+            for (uint32_t p = node.child[k]; p < node.child[k] + node.count[k]; p++) {
+                if (leafTest(primIndices[p], tMax))
+                    have_one = true;
+            }
+        }
+        for (int j = numHit - 1; j >= 0; j--) {
+            int k = order[j];
+            if (node.count[k] == 0 && tNear[k] <= tMax)
+                stack[stackSize++] = { node.child[k], tNear[k] };
+        }
+    }
+    RayStats::countTests(boxTests, primTests);
+    return have_one;
+}
+
+template <typename LeafTest>
+bool LinearBVH::traverseWideAny(const ray &r, double tMax, LeafTest leafTest) const {
+    const glm::dvec3 &inv = r.getInverseDirection();
+    const double o[3] = { r.getPosition()[0], r.getPosition()[1], r.getPosition()[2] };
+    const double invDir[3] = { inv[0], inv[1], inv[2] };
+
+    uint32_t stack[WIDE_STACK_SIZE];
+    int stackSize = 0;
+    stack[stackSize++] = 0;
+    uint64_t boxTests = 0, primTests = 0;
+    while (stackSize > 0) {
+        const WideBVHNode &node = wideNodes[stack[--stackSize]];
+        double tNear[4];
+        int mask = wideNodeTest(node, o, invDir, tMax, tNear);
+        boxTests += node.numChildren;
+        for (int k = 0; k < node.numChildren; k++) {
+            if (!(mask & (1 << k)))
+                continue;
+            if (node.count[k] == 0) {
+                stack[stackSize++] = node.child[k];
+                continue;
+            }
+            for (uint32_t p = node.child[k]; p < node.child[k] + node.count[k]; p++) {
+                primTests++;
+                if (leafTest(primIndices[p])) {
+                    RayStats::countTests(boxTests, primTests);
+                    return true;
+                }
+            }
+        }
+    }
+    RayStats::countTests(boxTests, primTests);
+    return false;
+}
+
+// The scene-level BVH over all geometry. Trimeshes are single objects here,
+// each with a BVH over its own faces.
 class BVH {
     private:
         const Scene *scene;
-        BVHNode *root;
+        std::vector<Geometry*> objects;
+        LinearBVH tree;
+        BVHBuildOptions options;
+        double buildTime = 0.0; // seconds, meshes included
 
-        void buildBVH();
+        void buildBVH(const BVHBuildOptions &options);
+        std::vector<BoundingBox> objectBounds() const;
 
     public:
-        BVH(const Scene *scene) {
+        BVH(const Scene *scene, const BVHBuildOptions &options = BVHBuildOptions()) {
             this->scene = scene;
-            buildBVH();
+            this->options = options;
+            buildBVH(options);
         }
 
+        BVH(const BVH &) = delete;
+        BVH &operator=(const BVH &) = delete;
+
+        // Call after the objects' bounding boxes were recomputed for new
+        // transforms. Returns true if the tree had to be rebuilt.
+        bool refit();
+
         bool intersect(ray &r, isect &i) const;
-};
\ No newline at end of file
+        // Closest hits for the rays of a packet (rays[k] is lane k). Returns
+        // the lanes that hit something.
+        RayPacket::Mask intersectPacket(const RayPacket &packet, ray *rays, isect *hits) const;
+        bool occluded(ray &r, double tMin, double tMax, bool &transmissive) const;
+        const BVHStats &getStats() const { return tree.getStats(); }
+        double getBuildTime() const { return buildTime; }
+        const BVHBuildOptions &getOptions() const { return options; }
+};
@@ -0,0 +1,41 @@
+#include "RayPacket.h"
+
+#include <algorithm>
+
+void RayPacket::init(const ray *rays, int n) {
+    size = n;
+    for (int axis = 0; axis < 3; axis++) {
+        for (int k = 0; k < n; k++) {
+            org[axis][k] = rays[k].getPosition()[axis];
+            dir[axis][k] = rays[k].getDirection()[axis];
+            invDir[axis][k] = rays[k].getInverseDirection()[axis];
+        }
+    }
+    updateBounds();
+}
+
+void RayPacket::update() {
+    for (int axis = 0; axis < 3; axis++) {
+        for (int k = 0; k < size; k++)
+            invDir[axis][k] = 1.0 / dir[axis][k];
+    }
+    updateBounds();
+}
+
+void RayPacket::updateBounds() {
+    coherent = true;
+    for (int axis = 0; axis < 3; axis++) {
+        orgMin[axis] = *std::min_element(org[axis], org[axis] + size);
+        orgMax[axis] = *std::max_element(org[axis], org[axis] + size);
+        invMin[axis] = *std::min_element(invDir[axis], invDir[axis] + size);
+        invMax[axis] = *std::max_element(invDir[axis], invDir[axis] + size);
+
+        // A zero component makes the inverse infinite, which the interval
+        // test cannot handle; treat it like a change of sign.
+        dirIsNeg[axis] = dir[axis][0] < 0.0;
+        for (int k = 0; k < size; k++) {
+            if (dir[axis][k] == 0.0 || (dir[axis][k] < 0.0) != (dirIsNeg[axis] != 0))
+                coherent = false;
+        }
+    }
+}
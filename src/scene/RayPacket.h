@@ -0,0 +1,39 @@
+#pragma once
+
+#include <cstdint>
+
+#include <glm/vec3.hpp>
+
+#include "ray.h"
+
+// A bundle of up to SIZE rays traced through the BVH together, for the
+// coherent primary rays of a block of pixels. Each node is tested once for
+// the whole bundle instead of once per ray, and the ray data is kept per
+// axis (structure of arrays) so the per-lane tests are simple loops the
+// compiler can vectorize.
+struct RayPacket {
+    static const int SIZE = 16;
+    typedef uint32_t Mask; // bit k stands for lane k
+
+    int size = 0;
+    double org[3][SIZE];
+    double dir[3][SIZE];
+    double invDir[3][SIZE];
+
+    // Bounds of the origins and inverse directions over all lanes. When the
+    // lanes agree on the sign of every direction component (coherent), these
+    // give a conservative answer for the whole packet with one slab test.
+    double orgMin[3], orgMax[3];
+    double invMin[3], invMax[3];
+    bool coherent = false;
+    int dirIsNeg[3]; // per axis, of the first lane (of all lanes if coherent)
+
+    // Fill the packet from rays[0..n), n <= SIZE.
+    void init(const ray *rays, int n);
+    // Recompute everything derived from org and dir, after changing them.
+    void update();
+    // Same, keeping invDir as it is.
+    void updateBounds();
+
+    Mask all() const { return (Mask(1) << size) - 1; }
+};
@@ -0,0 +1,88 @@
+#include "RayStats.h"
+
+#include <atomic>
+
+#include "../ui/TraceUI.h"
+
+namespace {
+
+enum Counter { PRIMARY, SHADOW, REFLECTION, REFRACTION, BOX_TESTS, PRIMITIVE_TESTS, NUM_COUNTERS };
+
+// Only the owning thread adds to a block, so a plain load and store does
+// (no locked read-modify-write); the counters are atomics just so that
+// total() may read them while the render runs.
+struct alignas(64) ThreadBlock {
+    std::atomic<uint64_t> count[NUM_COUNTERS];
+
+    void add(Counter c, uint64_t n) {
+        count[c].store(count[c].load(std::memory_order_relaxed) + n,
+                       std::memory_order_relaxed);
+    }
+    uint64_t get(Counter c) const { return count[c].load(std::memory_order_relaxed); }
+};
+
+// One per render worker, and the spare at MAX_THREADS. Every other thread
+// (the UI thread, the progressive render's driver, BVH build threads) shares
+// the spare, so it would see the same contention the blocks are here to
+// avoid if any of them traced a lot. None does: all tracing runs on the
+// render pool, and the driver and build threads count nothing.
+ThreadBlock blocks[MAX_THREADS + 1];
+
+ThreadBlock &threadBlock() { return blocks[ray_thread_id]; }
+
+} // anonymous namespace
+
+RayStats &RayStats::operator+=(const RayStats &other) {
+    primary += other.primary;
+    shadow += other.shadow;
+    reflection += other.reflection;
+    refraction += other.refraction;
+    boxTests += other.boxTests;
+    primitiveTests += other.primitiveTests;
+    return *this;
+}
+
+void RayStats::print(std::ostream &out, double seconds) const {
+    out << "Rays traced: " << rays() << " (primary " << primary << ", shadow "
+        << shadow << ", reflection " << reflection << ", refraction "
+        << refraction << ")" << std::endl;
+    out << "Box tests: " << boxTests << ", primitive tests: " << primitiveTests
+        << std::endl;
+    out << "Time: " << seconds << " s";
+    if (seconds > 0.0)
+        out << ", " << (double)rays() / seconds << " rays/s";
+    out << std::endl;
+}
+
+void RayStats::countRay(ray::RayType type) {
+    static const Counter counters[] = { PRIMARY, REFLECTION, REFRACTION, SHADOW };
+    threadBlock().add(counters[type], 1);
+}
+
+void RayStats::countTests(uint64_t boxes, uint64_t primitives) {
+    ThreadBlock &block = threadBlock();
+    block.add(BOX_TESTS, boxes);
+    block.add(PRIMITIVE_TESTS, primitives);
+}
+
+RayStats RayStats::total() {
+    RayStats stats;
+    for (const ThreadBlock &block : blocks) {
+        stats.primary += block.get(PRIMARY);
+        stats.shadow += block.get(SHADOW);
+        stats.reflection += block.get(REFLECTION);
+        stats.refraction += block.get(REFRACTION);
+        stats.boxTests += block.get(BOX_TESTS);
+        stats.primitiveTests += block.get(PRIMITIVE_TESTS);
+    }
+    return stats;
+}
+
+RayStats RayStats::reset() {
+    RayStats stats = total();
+    for (ThreadBlock &block : blocks) {
+        for (std::atomic<uint64_t> &c : block.count)
+            c.store(0, std::memory_order_relaxed);
+    }
+    return stats;
+}
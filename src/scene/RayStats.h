@@ -0,0 +1,37 @@
+#pragma once
+
+#include <cstdint>
+#include <ostream>
+
+#include "ray.h"
+
+// Totals of the work done while rendering: rays made, by type, and the box
+// and primitive tests of the BVH traversals. Every render thread counts into
+// its own block, a cache line of its own that no other thread writes to, so
+// counting needs no locks and causes no false sharing; the blocks are only
+// added up (merged) when someone asks for the totals, e.g. at the end of a
+// frame.
+struct RayStats {
+    uint64_t primary = 0;
+    uint64_t shadow = 0;
+    uint64_t reflection = 0;
+    uint64_t refraction = 0;
+    uint64_t boxTests = 0;       // one per node test, a whole packet's included
+    uint64_t primitiveTests = 0; // one per leaf entry tested, at every level
+
+    uint64_t rays() const { return primary + shadow + reflection + refraction; }
+    RayStats &operator+=(const RayStats &other);
+    // The counts, and how many rays per second that makes over seconds.
+    void print(std::ostream &out, double seconds) const;
+
+    // Count into the calling thread's block: that of render worker
+    // ray_thread_id, or a spare one shared by the threads that are none.
+    static void countRay(ray::RayType type);
+    static void countTests(uint64_t boxes, uint64_t primitives);
+
+    // The blocks of all threads merged. Only exact once the render is done;
+    // while it runs, the counts are whatever has been stored so far.
+    static RayStats total();
+    // Same, and start all blocks over from zero. Call between renders.
+    static RayStats reset();
+};
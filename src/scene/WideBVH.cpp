@@ -0,0 +1,245 @@
+// Box tests for the 4-wide BVH, one per instruction set, and the pick of
+// the one to use on this CPU.
+//
+// All of them do exactly what LinearBVH::intersectNode does for a single
+// box, in double precision on the float bounds: per axis, the two slab
+// distances are ordered (with a "greater than" test, which costs less than
+// picking the slabs by the sign of the direction here) and then only narrow the
+// [tNear, tFar] interval when they compare as closer, so NaNs (origin on a
+// slab of an axis the ray is parallel to) leave the interval alone.
+//
+// Builds with RAY_FLOAT_GEOMETRY use a single precision test instead, which
+// widens its interval by a bound on its rounding errors: it may report
+// boxes the double test misses, never the other way round, so traversal
+// finds the same hits.
+
+#include "BVH.h"
+#include "ray.h"
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define WIDE_BVH_X86 1
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#endif
+
+#include <algorithm>
+#include <cmath>
+
+// GCC and Clang only emit AVX (or, on 32-bit x86, SSE2) instructions in
+// functions marked for it; MSVC emits whatever intrinsics it is given.
+#if defined(__GNUC__)
+#define TARGET_SSE2 __attribute__((target("sse2")))
+#define TARGET_AVX __attribute__((target("avx")))
+#else
+#define TARGET_SSE2
+#define TARGET_AVX
+#endif
+
+namespace {
+
+int wideNodeTestScalar(const WideBVHNode &node, const double o[3],
+                       const double invDir[3], double tMax, double tNear[4]) {
+    int mask = 0;
+    for (int k = 0; k < node.numChildren; k++) {
+        double tMin = -1.0e308;
+        double tFar = 1.0e308;
+        for (int axis = 0; axis < 3; axis++) {
+            double t1 = (node.bmin[axis][k] - o[axis]) * invDir[axis];
+            double t2 = (node.bmax[axis][k] - o[axis]) * invDir[axis];
+            if (t1 > t2)
+                std::swap(t1, t2);
+            if (t1 > tMin)
+                tMin = t1;
+            if (t2 < tFar)
+                tFar = t2;
+        }
+        tNear[k] = tMin;
+        if (tMin <= tFar && tFar >= RAY_EPSILON && tMin <= tMax)
+            mask |= 1 << k;
+    }
+    return mask;
+}
+
+#ifdef WIDE_BVH_X86
+
+// SSE2 is part of x86-64, so this needs no CPU check there. Two children per
+// register, and without blendv the selects are done with and/andnot/or.
+TARGET_SSE2
+inline __m128d select(__m128d mask, __m128d a, __m128d b) {
+    return _mm_or_pd(_mm_and_pd(mask, a), _mm_andnot_pd(mask, b));
+}
+
+TARGET_SSE2
+int wideNodeTestSSE2(const WideBVHNode &node, const double o[3],
+                     const double invDir[3], double tMax, double tNear[4]) {
+    int mask = 0;
+    for (int half = 0; half < 2; half++) {
+        __m128d tMin = _mm_set1_pd(-1.0e308);
+        __m128d tFar = _mm_set1_pd(1.0e308);
+        for (int axis = 0; axis < 3; axis++) {
+            __m128d org = _mm_set1_pd(o[axis]);
+            __m128d inv = _mm_set1_pd(invDir[axis]);
+            __m128d lo = _mm_cvtps_pd(_mm_castsi128_ps(
+                _mm_loadl_epi64((const __m128i *)&node.bmin[axis][2 * half])));
+            __m128d hi = _mm_cvtps_pd(_mm_castsi128_ps(
+                _mm_loadl_epi64((const __m128i *)&node.bmax[axis][2 * half])));
+            __m128d t1 = _mm_mul_pd(_mm_sub_pd(lo, org), inv);
+            __m128d t2 = _mm_mul_pd(_mm_sub_pd(hi, org), inv);
+            __m128d swap = _mm_cmpgt_pd(t1, t2);
+            __m128d tEnter = select(swap, t2, t1);
+            __m128d tExit = select(swap, t1, t2);
+            tMin = select(_mm_cmpgt_pd(tEnter, tMin), tEnter, tMin);
+            tFar = select(_mm_cmplt_pd(tExit, tFar), tExit, tFar);
+        }
+        _mm_storeu_pd(&tNear[2 * half], tMin);
+        __m128d hit = _mm_and_pd(_mm_cmple_pd(tMin, tFar),
+                                 _mm_cmpge_pd(tFar, _mm_set1_pd(RAY_EPSILON)));
+        hit = _mm_and_pd(hit, _mm_cmple_pd(tMin, _mm_set1_pd(tMax)));
+        mask |= _mm_movemask_pd(hit) << (2 * half);
+    }
+    return mask & ((1 << node.numChildren) - 1);
+}
+
+#ifdef RAY_FLOAT_GEOMETRY
+
+/*
+ * Single precision, four children per register, on the bounds as stored.
+ * Rounding the ray to float moves the origin by up to 2^-24 |o| per axis,
+ * which shifts that axis's distances by up to 2^-24 |o| |invDir|; the
+ * subtraction and multiplication add a relative error of about 3 * 2^-24.
+ * Each axis's interval is widened by four times the first, and the result
+ * by more than five times the second, which also covers rounding in the
+ * widening itself. Axes with an infinite inverse direction give +-infinity
+ * or NaN just like the double test, since rounding cannot move the origin
+ * across a (float) slab.
+ */
+TARGET_SSE2
+int wideNodeTestSSEFloat(const WideBVHNode &node, const double o[3],
+                         const double invDir[3], double tMax, double tNear[4]) {
+    const __m128 signBit = _mm_set1_ps(-0.0f);
+    __m128 tMin = _mm_set1_ps(-INFINITY);
+    __m128 tFar = _mm_set1_ps(INFINITY);
+    for (int axis = 0; axis < 3; axis++) {
+        float of = (float)o[axis];
+        float inv = (float)invDir[axis];
+        float err = std::isfinite(inv) ? std::fabs(of) * std::fabs(inv) * (1.0f / (1 << 22)) : 0.0f;
+        __m128 org = _mm_set1_ps(of);
+        __m128 invv = _mm_set1_ps(inv);
+        __m128 errv = _mm_set1_ps(err);
+        __m128 t1 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.bmin[axis]), org), invv);
+        __m128 t2 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.bmax[axis]), org), invv);
+        __m128 swap = _mm_cmpgt_ps(t1, t2);
+        __m128 tEnter = _mm_or_ps(_mm_and_ps(swap, t2), _mm_andnot_ps(swap, t1));
+        __m128 tExit = _mm_or_ps(_mm_and_ps(swap, t1), _mm_andnot_ps(swap, t2));
+        tEnter = _mm_sub_ps(tEnter, errv);
+        tExit = _mm_add_ps(tExit, errv);
+        __m128 closer = _mm_cmpgt_ps(tEnter, tMin);
+        tMin = _mm_or_ps(_mm_and_ps(closer, tEnter), _mm_andnot_ps(closer, tMin));
+        closer = _mm_cmplt_ps(tExit, tFar);
+        tFar = _mm_or_ps(_mm_and_ps(closer, tExit), _mm_andnot_ps(closer, tFar));
+    }
+    const __m128 rel = _mm_set1_ps(1.0f / (1 << 20));
+    tMin = _mm_sub_ps(tMin, _mm_mul_ps(_mm_andnot_ps(signBit, tMin), rel));
+    tFar = _mm_add_ps(tFar, _mm_mul_ps(_mm_andnot_ps(signBit, tFar), rel));
+    _mm_storeu_pd(tNear, _mm_cvtps_pd(tMin));
+    _mm_storeu_pd(tNear + 2, _mm_cvtps_pd(_mm_movehl_ps(tMin, tMin)));
+
+    // Round the limits the generous way.
+    float tMaxF = (float)tMax;
+    if (tMaxF < tMax)
+        tMaxF = std::nextafter(tMaxF, INFINITY);
+    float epsilonF = (float)RAY_EPSILON;
+    if (epsilonF > RAY_EPSILON)
+        epsilonF = std::nextafter(epsilonF, 0.0f);
+    __m128 hit = _mm_and_ps(_mm_cmple_ps(tMin, tFar),
+                            _mm_cmpge_ps(tFar, _mm_set1_ps(epsilonF)));
+    hit = _mm_and_ps(hit, _mm_cmple_ps(tMin, _mm_set1_ps(tMaxF)));
+    return _mm_movemask_ps(hit) & ((1 << node.numChildren) - 1);
+}
+
+#endif // RAY_FLOAT_GEOMETRY
+
+TARGET_AVX
+int wideNodeTestAVX(const WideBVHNode &node, const double o[3],
+                    const double invDir[3], double tMax, double tNear[4]) {
+    __m256d tMin = _mm256_set1_pd(-1.0e308);
+    __m256d tFar = _mm256_set1_pd(1.0e308);
+    for (int axis = 0; axis < 3; axis++) {
+        __m256d org = _mm256_set1_pd(o[axis]);
+        __m256d inv = _mm256_set1_pd(invDir[axis]);
+        __m256d lo = _mm256_cvtps_pd(_mm_load_ps(node.bmin[axis]));
+        __m256d hi = _mm256_cvtps_pd(_mm_load_ps(node.bmax[axis]));
+        __m256d t1 = _mm256_mul_pd(_mm256_sub_pd(lo, org), inv);
+        __m256d t2 = _mm256_mul_pd(_mm256_sub_pd(hi, org), inv);
+        __m256d swap = _mm256_cmp_pd(t1, t2, _CMP_GT_OQ);
+        __m256d tEnter = _mm256_blendv_pd(t1, t2, swap);
+        __m256d tExit = _mm256_blendv_pd(t2, t1, swap);
+        tMin = _mm256_blendv_pd(tMin, tEnter, _mm256_cmp_pd(tEnter, tMin, _CMP_GT_OQ));
+        tFar = _mm256_blendv_pd(tFar, tExit, _mm256_cmp_pd(tExit, tFar, _CMP_LT_OQ));
+    }
+    _mm256_storeu_pd(tNear, tMin);
+    __m256d hit = _mm256_and_pd(_mm256_cmp_pd(tMin, tFar, _CMP_LE_OQ),
+                                _mm256_cmp_pd(tFar, _mm256_set1_pd(RAY_EPSILON), _CMP_GE_OQ));
+    hit = _mm256_and_pd(hit, _mm256_cmp_pd(tMin, _mm256_set1_pd(tMax), _CMP_LE_OQ));
+    return _mm256_movemask_pd(hit) & ((1 << node.numChildren) - 1);
+}
+
+bool cpuHasAVX() {
+#if defined(_MSC_VER)
+    // AVX needs the instructions (CPUID.1:ECX bit 28) and an OS that saves
+    // the YMM registers (OSXSAVE, bit 27, and XCR0 bits 1-2).
+    int info[4];
+    __cpuid(info, 1);
+    bool osxsave = (info[2] & (1 << 27)) != 0;
+    bool avx = (info[2] & (1 << 28)) != 0;
+    return osxsave && avx && (_xgetbv(0) & 0x6) == 0x6;
+#elif defined(__GNUC__)
+    return __builtin_cpu_supports("avx");
+#else
+    return false;
+#endif
+}
+
+bool cpuHasSSE2() {
+#if defined(__x86_64__) || defined(_M_X64)
+    return true;
+#elif defined(_MSC_VER)
+    int info[4];
+    __cpuid(info, 1);
+    return (info[3] & (1 << 26)) != 0;
+#elif defined(__GNUC__)
+    return __builtin_cpu_supports("sse2");
+#else
+    return false;
+#endif
+}
+
+#endif // WIDE_BVH_X86
+
+struct WideNodeTestChoice {
+    WideNodeTest test;
+    const char *name;
+};
+
+WideNodeTestChoice chooseWideNodeTest() {
+#ifdef WIDE_BVH_X86
+#ifdef RAY_FLOAT_GEOMETRY
+    if (cpuHasSSE2())
+        return { wideNodeTestSSEFloat, "SSE2 float" };
+#endif
+    if (cpuHasAVX())
+        return { wideNodeTestAVX, "AVX" };
+    if (cpuHasSSE2())
+        return { wideNodeTestSSE2, "SSE2" };
+#endif
+    return { wideNodeTestScalar, "scalar" };
+}
+
+const WideNodeTestChoice wideNodeTestChoice = chooseWideNodeTest();
+
+} // anonymous namespace
+
+const WideNodeTest LinearBVH::wideNodeTest = wideNodeTestChoice.test;
+const char *const LinearBVH::wideNodeTestName = wideNodeTestChoice.name;
@@ -26,30 +26,26 @@ bool BoundingBox::intersects(const glm::dvec3 &point) const {
 
 bool BoundingBox::intersect(const ray &r, double &tMin, double &tMax) const {
   /*
-   * Kay/Kajiya algorithm.
+   * Kay/Kajiya algorithm, multiplying by the ray's cached inverse direction.
+   * The sign of the direction picks which slab is entered first, so t1 <= t2
+   * without a swap. An axis the ray is parallel to gives +-infinity for both:
+   * the interval is left alone when the origin is between the slabs, and the
+   * box is missed otherwise. NaNs (origin exactly on a slab of such an axis)
+   * fail both comparisons and leave the interval untouched.
    */
   glm::dvec3 R0 = r.getPosition();
-  glm::dvec3 Rd = r.getDirection();
+  const glm::dvec3 &invD = r.getInverseDirection();
   tMin = -1.0e308; // 1.0e308 is close to infinity... close enough
                    // for us!
   tMax = 1.0e308;
-  double ttemp;
 
   for (int currentaxis = 0; currentaxis < 3; currentaxis++) {
-    double vd = Rd[currentaxis];
-    // if the ray is parallel to the face's plane (=0.0)
-    if (vd == 0.0)
-      continue;
-    double v1 = bmin[currentaxis] - R0[currentaxis];
-    double v2 = bmax[currentaxis] - R0[currentaxis];
+    bool neg = r.getDirSign(currentaxis);
+    double near = neg ? bmax[currentaxis] : bmin[currentaxis];
+    double far = neg ? bmin[currentaxis] : bmax[currentaxis];
     // two slab intersections
-    double t1 = v1 / vd;
-    double t2 = v2 / vd;
-    if (t1 > t2) { // swap t1 & t2
-      ttemp = t1;
-      t1 = t2;
-      t2 = ttemp;
-    }
+    double t1 = (near - R0[currentaxis]) * invD[currentaxis];
+    double t2 = (far - R0[currentaxis]) * invD[currentaxis];
     if (t1 > tMin)
       tMin = t1;
     if (t2 < tMax)
@@ -1,5 +1,6 @@
 #include <cmath>
 #include <iostream>
+#include <limits>
 
 #include "light.h"
 #include <glm/glm.hpp>
@@ -16,7 +17,17 @@ glm::dvec3 DirectionalLight::shadowAttenuation(const ray &r,
                                                const glm::dvec3 &p) const {
   // YOUR CODE HERE:
   // You should implement shadow-handling code here.
-	ray new_ray = r;
+  // Cheap any-hit query first; only translucent blockers need the walk below.
+  ray new_ray = r;
+  bool transmissive;
+  // Closer than 0.000001 is the surface itself, as in the walk below.
+  if (getScene()->occluded(new_ray, 0.000001,
+                           std::numeric_limits<double>::infinity(),
+                           transmissive))
+    return glm::dvec3(0, 0, 0);
+  if (!transmissive)
+    return glm::dvec3(1, 1, 1);
+
 	isect i;
 	// check if we have intersection
 	if (getScene()->intersect (new_ray, i)) {
@@ -89,7 +100,17 @@ glm::dvec3 PointLight::getDirection(const glm::dvec3 &P) const {
 glm::dvec3 PointLight::shadowAttenuation(const ray &r,
                                          const glm::dvec3 &p) const {
 	// TODO: handle when the light reflect inside the object?
-	ray new_ray = r;
+  // Cheap any-hit query first; only translucent blockers need the walk below.
+  // The ray may have been advanced past translucent surfaces already, so the
+  // light is that much closer than it is to p.
+  ray new_ray = r;
+  bool transmissive;
+  double tLight = glm::distance(position, p) - glm::distance(r.getPosition(), p);
+  if (getScene()->occluded(new_ray, RAY_EPSILON, tLight, transmissive))
+    return glm::dvec3(0, 0, 0);
+  if (!transmissive)
+    return glm::dvec3(1, 1, 1);
+
 	isect i;
 	// check if we have intersection
 	if (getScene()->intersect (new_ray, i)) {
@@ -1,21 +1,53 @@
 #include "ray.h"
 #include "../ui/TraceUI.h"
+#include "RayStats.h"
 #include "material.h"
 #include "scene.h"
 
+#include <algorithm>
+#include <deque>
+
+
+namespace {
+// Grows to the largest number of interpolated materials one primary ray has
+// needed and is then reused; a deque keeps handed-out references valid.
+thread_local std::deque<Material> scratchMaterials;
+thread_local size_t scratchMaterialsUsed = 0;
+} // namespace
 
 const Material &isect::getMaterial() const {
-  return material ? *material : obj->getMaterial();
+  if (!material) {
+    if (obj->interpolatesMaterial()) {
+      Material &m = allocScratchMaterial();
+      obj->interpolateMaterial(*this, m);
+      material = &m;
+    } else {
+      material = &obj->getMaterial();
+    }
+  }
+  return *material;
 }
 
+Material &isect::allocScratchMaterial() {
+  if (scratchMaterialsUsed == scratchMaterials.size())
+    scratchMaterials.emplace_back();
+  return scratchMaterials[scratchMaterialsUsed++];
+}
+
+void isect::releaseScratchMaterials() { scratchMaterialsUsed = 0; }
+
 ray::ray(const glm::dvec3 &pp, const glm::dvec3 &dd, const glm::dvec3 &w,
          RayType tt)
     : p(pp), d(dd), atten(w), t(tt) {
-  TraceUI::addRay(ray_thread_id);
+  updateInverse();
+  RayStats::countRay(tt);
 }
 
-ray::ray(const ray &other) : p(other.p), d(other.d), atten(other.atten) {
-  TraceUI::addRay(ray_thread_id);
+// A copy is the same ray, not another one to count.
+ray::ray(const ray &other)
+    : p(other.p), d(other.d), invD(other.invD), atten(other.atten),
+      t(other.t) {
+  std::copy(other.sign, other.sign + 3, sign);
 }
 
 ray::~ray() {}
@@ -23,6 +55,8 @@ ray::~ray() {}
 ray &ray::operator=(const ray &other) {
   p = other.p;
   d = other.d;
+  invD = other.invD;
+  std::copy(other.sign, other.sign + 3, sign);
   atten = other.atten;
   t = other.t;
   return *this;
@@ -30,4 +64,4 @@ ray &ray::operator=(const ray &other) {
 
 glm::dvec3 ray::at(const isect &i) const { return at(i.getT()); }
 
-thread_local unsigned int ray_thread_id = 0;
+thread_local unsigned int ray_thread_id = MAX_THREADS;
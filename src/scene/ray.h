@@ -13,13 +13,15 @@
 #include "material.h"
 #include <glm/vec2.hpp>
 #include <glm/vec3.hpp>
-#include <memory>
+
+#include <cmath>
 
 class SceneObject;
 class isect;
 
 /*
- * ray_thread_id: a thread local variable for statistical purpose.
+ * ray_thread_id: a thread local variable for statistical purpose. The render
+ * workers set it to their index; every other thread keeps MAX_THREADS.
  */
 extern thread_local unsigned int ray_thread_id;
 
@@ -42,15 +44,42 @@ public:
 
   glm::dvec3 getPosition() const { return p; }
   glm::dvec3 getDirection() const { return d; }
+  // 1 / direction per axis, +-infinity for a zero component. Kept up to date
+  // by setDirection() so box tests need no divisions.
+  const glm::dvec3 &getInverseDirection() const { return invD; }
+  // 1 if the direction is negative along axis (the sign bit, so -0.0 counts
+  // as negative like its infinite inverse does), else 0.
+  int getDirSign(int axis) const { return sign[axis]; }
   glm::dvec3 getAtten() const { return atten; }
   RayType type() const { return t; }
 
   void setPosition(const glm::dvec3 &pp) { p = pp; }
-  void setDirection(const glm::dvec3 &dd) { d = dd; }
+  void setDirection(const glm::dvec3 &dd) {
+    d = dd;
+    updateInverse();
+  }
+  // Put back a direction together with its inverse as returned by
+  // getInverseDirection(), e.g. after intersecting in local coordinates.
+  void setDirection(const glm::dvec3 &dd, const glm::dvec3 &invDD) {
+    d = dd;
+    invD = invDD;
+    updateSigns();
+  }
 
 private:
+  void updateInverse() {
+    invD = 1.0 / d;
+    updateSigns();
+  }
+  void updateSigns() {
+    for (int axis = 0; axis < 3; axis++)
+      sign[axis] = std::signbit(d[axis]) ? 1 : 0;
+  }
+
   glm::dvec3 p;
   glm::dvec3 d;
+  glm::dvec3 invD;
+  int sign[3];
   glm::dvec3 atten;
   RayType t;
 };
@@ -61,17 +90,20 @@ private:
 class isect {
 public:
   isect()
-      : obj(NULL), t(0.0), N(), uvCoordinates(), bary(), material(nullptr) {}
-  isect(const isect &other) { copyFromOther(other); }
-
-  ~isect() {}
-
-  isect &operator=(const isect &other) {
-    copyFromOther(other);
-    return *this;
+      : obj(NULL), t(0.0), N(), uvCoordinates(), bary(), face(-1),
+        material(nullptr) {}
+
+  // Hit records are copied around a lot in the intersection loops, so they
+  // only refer to materials owned elsewhere and stay trivially copyable.
+  isect(const isect &other) = default;
+  isect &operator=(const isect &other) = default;
+
+  // Setting the object also resets the material to the object's own.
+  void setObject(const SceneObject *o) {
+    obj = o;
+    material = nullptr;
   }
-
-  void setObject(const SceneObject *o) { obj = o; }
+  const SceneObject *getObject() const { return obj; }
 
   // Get/Set Time of flight
   void setT(double tt) { t = tt; }
@@ -80,45 +112,41 @@ public:
   void setN(const glm::dvec3 &n) { N = n; }
   glm::dvec3 getN() const { return N; }
 
-  void setMaterial(const Material &m) {
-    if (material)
-      *material = m;
-    else
-      material.reset(new Material(m));
-  }
+  // The material must outlive the isect; normally it is the one stored in
+  // the object that was hit.
+  void setMaterial(const Material &m) { material = &m; }
   void setUVCoordinates(const glm::dvec2 &coords) { uvCoordinates = coords; }
   glm::dvec2 getUVCoordinates() const { return uvCoordinates; }
   void setBary(const glm::dvec3 &weights) { bary = weights; }
   void setBary(const double alpha, const double beta, const double gamma) {
     setBary(glm::dvec3(alpha, beta, gamma));
   }
+  glm::dvec3 getBary() const { return bary; }
+  // Index of the mesh face that was hit, -1 for other objects.
+  void setFace(int f) { face = f; }
+  int getFace() const { return face; }
+
+  // Objects whose material varies over the surface (vertex colors) build it
+  // here on first use, in per-thread scratch storage.
   const Material &getMaterial() const;
 
-private:
-  void copyFromOther(const isect &other) {
-    if (this == &other)
-      return;
-    obj = other.obj;
-    t = other.t;
-    N = other.N;
-    bary = other.bary;
-    uvCoordinates = other.uvCoordinates;
-    if (other.material) {
-      setMaterial(*other.material);
-    } else {
-      material.reset();
-    }
-  }
+  // Scratch materials for the calling thread. Everything handed out stays
+  // valid until the next releaseScratchMaterials() on the same thread, which
+  // the tracer calls once per primary ray.
+  static Material &allocScratchMaterial();
+  static void releaseScratchMaterials();
 
+private:
   const SceneObject *obj;
   double t;
   glm::dvec3 N;
   glm::dvec2 uvCoordinates;
   glm::dvec3 bary;
+  int face;
 
-  // if this intersection has its own material (as opposed to one in its
-  // associated object) as in the case where the material was interpolated
-  std::unique_ptr<Material> material;
+  // nullptr until resolved: the object's own material, or an interpolated
+  // one in scratch storage.
+  mutable const Material *material;
 };
 
 const double RAY_EPSILON = 0.00000001;
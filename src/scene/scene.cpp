@@ -14,31 +14,72 @@ bool Geometry::intersect(ray &r, isect &i) const {
   double tmin, tmax;
   if (hasBoundingBoxCapability() && !(bounds.intersect(r, tmin, tmax)))
     return false;
-  // Transform the ray into the object's local coordinate space
-  glm::dvec3 pos = transform.globalToLocalCoords(r.getPosition());
-  glm::dvec3 dir =
-      transform.globalToLocalCoords(r.getPosition() + r.getDirection()) - pos;
+  // Transform the ray into the object's local coordinate space. Without a
+  // rotation or non-uniform scale, directions keep their orientation and
+  // only the origin has to move.
+  glm::dvec3 pos, dir;
+  switch (transform.kind()) {
+  case MatrixTransform::IDENTITY:
+    pos = r.getPosition();
+    dir = r.getDirection();
+    break;
+  case MatrixTransform::TRANSLATION:
+    pos = r.getPosition() - transform.getOffset();
+    dir = r.getDirection();
+    break;
+  case MatrixTransform::UNIFORM_SCALE:
+    pos = (r.getPosition() - transform.getOffset()) / transform.getScale();
+    dir = r.getDirection() / transform.getScale();
+    break;
+  default:
+    pos = transform.globalToLocalCoords(r.getPosition());
+    dir = transform.globalToLocalCoords(r.getPosition() + r.getDirection()) -
+          pos;
+    break;
+  }
   double length = glm::length(dir);
   dir = glm::normalize(dir);
   // Backup World pos/dir, and switch to local pos/dir
   glm::dvec3 Wpos = r.getPosition();
   glm::dvec3 Wdir = r.getDirection();
+  glm::dvec3 WinvDir = r.getInverseDirection();
   r.setPosition(pos);
   r.setDirection(dir);
   bool rtrn = false;
   if (intersectLocal(r, i)) {
     // Transform the intersection point & normal returned back into
-    // global space.
-    i.setN(transform.localToGlobalCoordsNormal(i.getN()));
+    // global space. The normal matrix of the simple transforms is a
+    // multiple of the identity.
+    if (transform.kind() == MatrixTransform::GENERAL)
+      i.setN(transform.localToGlobalCoordsNormal(i.getN()));
+    else
+      i.setN(glm::normalize(i.getN()));
     i.setT(i.getT() / length);
     rtrn = true;
   }
   // Restore World pos/dir
   r.setPosition(Wpos);
-  r.setDirection(Wdir);
+  r.setDirection(Wdir, WinvDir);
   return rtrn;
 }
 
+RayPacket::Mask Geometry::intersectPacket(const RayPacket &packet, ray *rays,
+                                          RayPacket::Mask lanes, double *tMax,
+                                          isect *hits) const {
+  RayPacket::Mask found = 0;
+  for (int k = 0; k < packet.size; k++) {
+    if (!(lanes & (RayPacket::Mask(1) << k)))
+      continue;
+    isect cur;
+    if (intersect(rays[k], cur) && cur.getT() < tMax[k]) {
+      hits[k] = cur;
+      tMax[k] = cur.getT();
+      found |= RayPacket::Mask(1) << k;
+    }
+  }
+  return found;
+}
+
 bool Geometry::hasBoundingBoxCapability() const {
   // by default, primitives do not have to specify a bounding box. If this
   // method returns true for a primitive, then either the ComputeBoundingBox()
@@ -91,9 +132,16 @@ void Geometry::ComputeBoundingBox() {
   bounds.setMin(glm::dvec3(newMin));
 }
 
+void Geometry::setTransform(const MatrixTransform &transform) {
+  this->transform = transform;
+  if (scene)
+    scene->transformsChanged();
+}
+
 Scene::Scene() { ambientIntensity = glm::dvec3(0, 0, 0); }
 
 Scene::~Scene() {
+  delete bvhTree;
   for (auto &obj : objects)
     delete obj;
   for (auto &light : lights)
@@ -104,13 +152,39 @@ void Scene::add(Geometry *obj) {
   obj->ComputeBoundingBox();
   sceneBounds.merge(obj->getBoundingBox());
   objects.emplace_back(obj);
+  bvhDirty = true;
 }
 
 void Scene::add(Light *light) { lights.emplace_back(light); }
 
-void Scene::buildBVH() {
-  bvhTree = new BVH(this);
-  return;
+void Scene::updateBounds() {
+  sceneBounds = BoundingBox();
+  for (Geometry *obj : objects) {
+    obj->ComputeBoundingBox();
+    sceneBounds.merge(obj->getBoundingBox());
+  }
+}
+
+bool Scene::refitBVH() {
+  updateBounds();
+  transformsDirty = false;
+  return bvhTree && !bvhDirty && bvhTree->refit();
+}
+
+bool Scene::buildBVH(const BVHBuildOptions &options) {
+  if (bvhTree && !bvhDirty && bvhTree->getOptions().sameTree(options)) {
+    if (!transformsDirty)
+      return false;
+    refitBVH();
+    return true;
+  }
+  if (bvhDirty || transformsDirty)
+    updateBounds();
+  delete bvhTree;
+  bvhTree = new BVH(this, options);
+  bvhDirty = false;
+  transformsDirty = false;
+  return true;
 }
 
 
@@ -123,6 +197,16 @@ bool Scene::intersect(ray &r, isect &i) const {
   return have_one;
 }
 
+RayPacket::Mask Scene::intersectPacket(const RayPacket &packet, ray *rays,
+                                       isect *hits) const {
+  return bvhTree->intersectPacket(packet, rays, hits);
+}
+
+bool Scene::occluded(ray &r, double tMin, double tMax,
+                     bool &transmissive) const {
+  return bvhTree->occluded(r, tMin, tMax, transmissive);
+}
+
 TextureMap *Scene::getTexture(string name) {
   auto itr = textureCache.find(name);
   if (itr == textureCache.end()) {
@@ -18,6 +18,7 @@
 
 #include "bbox.h"
 #include "camera.h"
+#include "RayPacket.h"
 #include "material.h"
 #include "ray.h"
 
@@ -31,6 +32,7 @@
 using std::unique_ptr;
 
 class BVH;
+struct BVHBuildOptions;
 class Light;
 class Scene;
 
@@ -63,19 +65,55 @@ inline glm::dvec3 operator*(const glm::dmat4x4 &mat, const glm::dvec3 &vec) {
 }
 
 class MatrixTransform {
+public:
+  // What the matrix actually does, worked out once so the per-ray code can
+  // skip the matrix products for the common cases. UNIFORM_SCALE is a
+  // positive uniform scale followed by an optional translation.
+  enum Kind { IDENTITY, TRANSLATION, UNIFORM_SCALE, GENERAL };
+
 protected:
   glm::dmat4x4 xform;
   glm::dmat4x4 inverse;
   glm::dmat3x3 normi;
 
+  Kind xformKind;
+  glm::dvec3 offset; // translation part, for all but GENERAL
+  double scale;      // scale factor, for all but GENERAL
+
+  void classify() {
+    offset = glm::dvec3(xform[3]);
+    scale = xform[0][0];
+    bool affine = xform[0][3] == 0.0 && xform[1][3] == 0.0 &&
+                  xform[2][3] == 0.0 && xform[3][3] == 1.0;
+    bool uniform = scale > 0.0;
+    for (int col = 0; col < 3; col++) {
+      for (int row = 0; row < 3; row++)
+        uniform = uniform && xform[col][row] == (col == row ? scale : 0.0);
+    }
+    if (!affine || !uniform)
+      xformKind = GENERAL;
+    else if (scale != 1.0)
+      xformKind = UNIFORM_SCALE;
+    else if (offset != glm::dvec3(0.0))
+      xformKind = TRANSLATION;
+    else
+      xformKind = IDENTITY;
+  }
+
 public:
   MatrixTransform() : MatrixTransform(glm::dmat4(1.0)) {}
 
   MatrixTransform(const glm::dmat4x4 &xform) : xform{xform} {
     this->inverse = glm::inverse(this->xform);
     this->normi = glm::transpose(glm::inverse(glm::dmat3x3(this->xform)));
+    classify();
   }
 
+  Kind kind() const { return xformKind; }
+  // Only meaningful when kind() != GENERAL.
+  const glm::dvec3 &getOffset() const { return offset; }
+  double getScale() const { return scale; }
+
   // Coordinate-Space transformation
   glm::dvec3 globalToLocalCoords(const glm::dvec3 &v) const {
     return inverse * v;
@@ -109,6 +147,13 @@ public:
   // intersections performed in the global coordinate space.
   bool intersect(ray &r, isect &i) const;
 
+  // Intersect the given lanes of a packet (rays[k] is lane k) and keep the
+  // hits closer than tMax[k] in hits[k], lowering tMax[k]. Returns the lanes
+  // that got a closer hit. The default runs intersect() lane by lane.
+  virtual RayPacket::Mask intersectPacket(const RayPacket &packet, ray *rays,
+                                          RayPacket::Mask lanes, double *tMax,
+                                          isect *hits) const;
+
   virtual bool hasBoundingBoxCapability() const;
   const BoundingBox &getBoundingBox() const { return bounds; }
   glm::dvec3 getNormal() { return glm::dvec3(1.0, 0.0, 0.0); }
@@ -119,9 +164,10 @@ public:
   // this should be overridden if hasBoundingBoxCapability() is true.
   virtual BoundingBox ComputeLocalBoundingBox() { return BoundingBox(); }
 
-  void setTransform(const MatrixTransform &transform) {
-    this->transform = transform;
-  };
+  // Objects already in the scene have the scene's BVH refitted on the next
+  // Scene::buildBVH().
+  virtual void setTransform(const MatrixTransform &transform);
+  virtual MatrixTransform getTransform() const { return transform; }
 
   Geometry(Scene *scene) : SceneElement(scene) {}
 
@@ -148,6 +194,12 @@ public:
   const Material &getMaterial() const { return this->material; };
   void setMaterial(Material *m) { this->material = *m; };
 
+  // Objects whose material varies over the surface override these to build
+  // the material at a hit point when shading asks for it (see isect).
+  virtual bool interpolatesMaterial() const { return false; }
+  virtual void interpolateMaterial([[maybe_unused]] const isect &i,
+                                   [[maybe_unused]] Material &m) const {}
+
   void glDraw(int quality, bool actualMaterials, bool actualTextures) const;
 
 protected:
@@ -173,6 +225,17 @@ public:
   void add(Light *light);
 
   bool intersect(ray &r, isect &i) const;
+  // Closest hits for all lanes of a packet (rays[k] is lane k); returns the
+  // lanes that hit something.
+  RayPacket::Mask intersectPacket(const RayPacket &packet, ray *rays,
+                                  isect *hits) const;
+
+  // Shadow-ray query: does an opaque object lie on the ray between tMin and
+  // tMax? Hits closer than tMin count as the surface the ray leaves from.
+  // Stops at the first such object instead of looking for the closest hit.
+  // 'transmissive' is set when translucent objects were crossed on the way,
+  // in which case the caller has to attenuate by them itself.
+  bool occluded(ray &r, double tMin, double tMax, bool &transmissive) const;
 
   auto beginLights() const { return lights.begin(); }
   auto endLights() const { return lights.end(); }
@@ -200,10 +263,26 @@ public:
 
   const BoundingBox &bounds() const { return sceneBounds; }
 
-  void buildBVH();
+  // The BVH is built on first use and kept until the geometry or the build
+  // options change, and refitted when objects were moved. Returns false if
+  // the cached tree was still good.
+  bool buildBVH(const BVHBuildOptions &options);
+  // Call after reshaping objects already in the scene.
+  void invalidateBVH() { bvhDirty = true; }
+  // Geometry::setTransform() calls this.
+  void transformsChanged() { transformsDirty = true; }
+  // Updates the bounds of the existing tree for the objects' current
+  // transforms instead of building a new one (unless that made it too slow,
+  // see BVHBuildOptions::refitRebuildRatio). Returns true if it rebuilt.
+  bool refitBVH();
+  const BVH *getBVH() const { return bvhTree; }
 
 private:
-  BVH *bvhTree;
+  void updateBounds();
+
+  BVH *bvhTree = nullptr;
+  bool bvhDirty = true;
+  bool transformsDirty = false;
   /* Do not try to access these members directly. If you need to iterate
      over e.g. lights, use the following loop:
 
@@ -1,6 +1,6 @@
+#include <chrono>
 #include <iostream>
 #include <stdarg.h>
-#include <time.h>
 #ifndef _MSC_VER
 #include <unistd.h>
 #else
@@ -15,6 +15,7 @@ extern int getopt(int argc, char **argv, const char *optstring);
 #include "CommandLineUI.h"
 
 #include "../RayTracer.h"
+#include "../scene/RayStats.h"
 
 using namespace std;
 
@@ -67,6 +68,13 @@ CommandLineUI::CommandLineUI(int argc, char **argv) : TraceUI() {
 
 int CommandLineUI::run() {
   assert(raytracer != 0);
+  // Nobody is there to stop it.
+  if (progressive() && getProgressiveSamples() <= 0 &&
+      getProgressiveTime() <= 0.0) {
+    std::cerr << "Progressive rendering needs progressive_samples or "
+                 "progressive_time to end." << std::endl;
+    return 1;
+  }
   raytracer->loadScene(rayName);
 
   if (raytracer->sceneLoaded()) {
@@ -75,17 +83,19 @@ int CommandLineUI::run() {
 
     raytracer->traceSetup(width, height);
 
-    clock_t start, end;
-    start = clock();
+    // Wall time: clock() would add up the time of all render threads.
+    RayStats::reset();
+    auto start = std::chrono::steady_clock::now();
 
     raytracer->traceImage(width, height);
     raytracer->waitRender();
-    if (aaSwitch()) {
+    // Progressive renders are supersampled already.
+    if (aaSwitch() && !progressive()) {
       raytracer->aaImage();
       raytracer->waitRender();
     }
 
-    end = clock();
+    auto end = std::chrono::steady_clock::now();
 
     // save image
     unsigned char *buf;
@@ -95,10 +105,8 @@ int CommandLineUI::run() {
     if (buf)
       writeImage(imgName, width, height, buf);
 
-    [[maybe_unused]] double t = (double)(end - start) / CLOCKS_PER_SEC;
-    //		int totalRays = TraceUI::resetCount();
-    //		std::cout << "total time = " << t << " seconds,
-    // rays traced = " << totalRays << std::endl;
+    double t = std::chrono::duration<double>(end - start).count();
+    RayStats::total().print(std::cout, t);
     return 0;
   } else {
     std::cerr << "Unable to load ray file '" << rayName << "'" << std::endl;
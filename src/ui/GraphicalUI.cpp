@@ -294,9 +294,10 @@ void GraphicalUI::cb_render(Fl_Widget *o, void *) {
     print(buffer, "Time: %.2f sec, Rays: %u, Aa: none", t_trace, imageRays);
     pUI->m_traceGlWindow->label(buffer);
     pUI->m_traceGlWindow->refresh();
-    if (pUI->aaSwitch() && !stopTrace) {
+    if (pUI->aaSwitch() && !pUI->progressive() && !stopTrace) {
       clock_t aaStart, aaTime;
       auto t_aaStart = std::chrono::high_resolution_clock::now();
+      pUI->raytracer->aaImage();
       auto t_total =
           std::chrono::duration<double, std::ratio<1>>(t_now - t_start).count();
       aaStart = now = prev = clock();
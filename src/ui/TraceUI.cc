@@ -5,6 +5,7 @@
 #else
 #include <dirent.h>
 #endif
+#include "../scene/RayStats.h"
 #include "../scene/cubeMap.h"
 #include "../scene/material.h"
 
@@ -26,15 +27,16 @@ template <typename T> void load(Json &j, const string &field, T &target) {
 
 } // anonymous namespace
 
-TraceUI::TraceUI() {
-  for (unsigned int i = 0; i < MAX_THREADS; i++)
-    rayCount[i] = 0;
-}
+TraceUI::TraceUI() {}
 
 TraceUI::~TraceUI() {}
 
 void TraceUI::setCubeMap(CubeMap *cm) { cubemap.reset(cm); }
 
+int TraceUI::getCount() { return (int)RayStats::total().rays(); }
+
+int TraceUI::resetCount() { return (int)RayStats::reset().rays(); }
+
 void TraceUI::loadFromJson(const char *file) {
   std::ifstream fin(file);
   Json json;
@@ -52,6 +54,19 @@ void TraceUI::loadFromJson(const char *file) {
   load(json, "filter_width", m_nFilterWidth);
   load(json, "anti_alias", m_antiAlias);
   load(json, "kdtree", m_kdTree);
+  load(json, "bvh_sah", m_bvhSAH);
+  load(json, "bvh_bins", m_nBvhBins);
+  load(json, "bvh_leaf_cost", m_bvhLeafCost);
+  load(json, "bvh_refit_ratio", m_bvhRefitRatio);
+  load(json, "bvh_stats", m_bvhStats);
+  load(json, "bvh_wide", m_bvhWide);
+  load(json, "packets", m_packets);
+  load(json, "wavefront", m_wavefront);
+  load(json, "sampler", m_sampler);
+  load(json, "tonemap", m_toneMap);
+  load(json, "progressive", m_progressive);
+  load(json, "progressive_samples", m_nProgressiveSamples);
+  load(json, "progressive_time", m_progressiveTime);
   load(json, "shadows", m_shadows);
   load(json, "smoothshade", m_smoothshade);
   load(json, "backface_culling", m_backface);
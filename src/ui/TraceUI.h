@@ -41,6 +41,19 @@ public:
   int getLeafSize() const { return m_nLeafSize; }
   int getFilterWidth() const { return m_nFilterWidth; }
   int getThreads() const { return m_threads; }
+  bool bvhSAH() const { return m_bvhSAH; }
+  int getBvhBins() const { return m_nBvhBins; }
+  double getBvhLeafCost() const { return m_bvhLeafCost; }
+  double getBvhRefitRatio() const { return m_bvhRefitRatio; }
+  bool bvhStats() const { return m_bvhStats; }
+  bool bvhWide() const { return m_bvhWide; }
+  bool packets() const { return m_packets; }
+  bool wavefront() const { return m_wavefront; }
+  const string &getSampler() const { return m_sampler; }
+  const string &getToneMap() const { return m_toneMap; }
+  bool progressive() const { return m_progressive; }
+  int getProgressiveSamples() const { return m_nProgressiveSamples; }
+  double getProgressiveTime() const { return m_progressiveTime; }
   bool aaSwitch() const { return m_antiAlias; }
   bool kdSwitch() const { return m_kdTree; }
   bool shadowSw() const { return m_shadows; }
@@ -52,37 +65,10 @@ public:
   bool internalReflection() const { return m_internalReflection; }
   bool backfaceSpecular() const { return m_backfaceSpecular; }
 
-  // ray counter
-  static void addRays(int number, int ctr) {
-    if (ctr >= 0)
-      rayCount[ctr] += number;
-  }
-  static void addRay(int ctr) {
-    if (ctr >= 0)
-      rayCount[ctr]++;
-  }
-  static int getCount(int ctr) { return ctr < 0 ? -1 : rayCount[ctr]; }
-  static int getCount() {
-    int total = 0;
-    for (int i = 0; i < m_threads; i++)
-      total += rayCount[i];
-    return total;
-  }
-  static int resetCount(int ctr) {
-    if (ctr < 0)
-      return -1;
-    int temp = rayCount[ctr];
-    rayCount[ctr] = 0;
-    return temp;
-  }
-  static int resetCount() {
-    int total = 0;
-    for (int i = 0; i < m_threads; i++) {
-      total += rayCount[i];
-      rayCount[i] = 0;
-    }
-    return total;
-  }
+  // Rays traced by all threads since the last resetCount(); see RayStats
+  // for the breakdown.
+  static int getCount();
+  static int resetCount();
 
   static int m_threads; // number of threads to run
   static bool m_debug;
@@ -102,8 +88,13 @@ protected:
   int m_nTreeDepth = 15;    // maximum kdTree depth
   int m_nLeafSize = 10;     // target number of objects per leaf
   int m_nFilterWidth = 1;   // width of cubemap filter
-
-  static int rayCount[MAX_THREADS]; // Ray counter
+  int m_nBvhBins = 16;      // number of SAH buckets per BVH split
+  double m_bvhLeafCost = 1.0; // SAH cost of one primitive test vs. one box test
+  double m_bvhRefitRatio = 1.5; // rebuild a refitted BVH past this SAH cost growth
+  string m_sampler = "stratified"; // points of jittered supersampling, see Sampler
+  string m_toneMap = "linear";     // framebuffer to 8 bits, see ToneMap
+  int m_nProgressiveSamples = 16; // progressive: samples per pixel, rounded down to a square
+  double m_progressiveTime = 0.0; // progressive: or stop after this many seconds
 
   // Determines whether or not to show debugging information
   // for individual rays.  Disabled by default for efficiency
@@ -111,6 +102,12 @@ protected:
   bool m_displayDebuggingInfo = false;
   bool m_antiAlias = false;    // Is antialiasing on?
   bool m_kdTree = true;        // use kd-tree?
+  bool m_bvhSAH = true;        // SAH splits (otherwise object median)
+  bool m_bvhStats = false;     // print the BVH build report
+  bool m_bvhWide = true;       // traverse 4-wide BVH nodes with SIMD box tests
+  bool m_packets = true;       // trace primary rays in 4x4 packets
+  bool m_wavefront = false;    // trace a tile bounce by bounce, not ray by ray
+  bool m_progressive = false;  // coarse image first, then add samples
   bool m_shadows = true;       // compute shadows?
   bool m_smoothshade = true;   // turn on/off smoothshading?
   bool m_backface = true;      // cull backfaces?
@@ -49,18 +49,6 @@ void setMaterialProperty(GLenum property, glm::dvec3 value) {
   glMaterialfv(GL_FRONT_AND_BACK, property, val);
 }
 
-// We need a special overload of this for TrimeshFace since it's not a
-// SceneObject anymore
-void setGLMaterial(const Material &mat, const TrimeshFace *object) {
-  isect i;
-  i.setObject(object->getParent());
-  setMaterialProperty(GL_AMBIENT, mat.ka(i));
-  setMaterialProperty(GL_DIFFUSE, mat.kd(i));
-  setMaterialProperty(GL_SPECULAR, mat.ks(i));
-  setMaterialProperty(GL_EMISSION, mat.ke(i));
-  glMaterialf(GL_FRONT_AND_BACK, GL_SHININESS, (GLfloat)mat.shininess(i));
-}
-
 void setGLMaterial(const Material &mat, const SceneObject *object) {
   // Setup material parameters
   isect i;
@@ -345,17 +333,18 @@ void Trimesh::glDrawLocal([[maybe_unused]] int quality, bool actualMaterials,
     displayList = glGenLists(1);
     glNewList(displayList, GL_COMPILE);
 
+    const TrimeshData::Normals &normals = data->normals;
     glBegin(GL_TRIANGLES);
-    for (Faces::const_iterator itr = faces.begin(); itr != faces.end(); ++itr) {
-      const int vert1 = (*(*itr))[0];
-      const int vert2 = (*(*itr))[1];
-      const int vert3 = (*(*itr))[2];
-      setGLMaterial(material, *itr);
-
+    for (const glm::ivec3 &face : data->faces) {
+      const int vert1 = face[0];
+      const int vert2 = face[1];
+      const int vert3 = face[2];
+      setGLMaterial(material, this);
+
+      const glm::dvec3 a = data->vertex(vert1);
+      const glm::dvec3 b = data->vertex(vert2);
+      const glm::dvec3 c = data->vertex(vert3);
       if (normals.empty()) {
-        const glm::dvec3 &a = vertices[vert1];
-        const glm::dvec3 &b = vertices[vert2];
-        const glm::dvec3 &c = vertices[vert3];
 
         glm::dvec3 cv = glm::cross(b - a, c - a);
 
@@ -366,18 +355,18 @@ void Trimesh::glDrawLocal([[maybe_unused]] int quality, bool actualMaterials,
       }
 
       if (!normals.empty())
-        glNormal3dv(&normals[vert1][0]);
-      glVertex3dv(&vertices[vert1][0]);
+        glNormal3dv(&data->normal(vert1)[0]);
+      glVertex3dv(&a[0]);
 
       if (!normals.empty())
-        glNormal3dv(&normals[vert2][0]);
+        glNormal3dv(&data->normal(vert2)[0]);
 
-      glVertex3dv(&vertices[vert2][0]);
+      glVertex3dv(&b[0]);
 
       if (!normals.empty())
-        glNormal3dv(&normals[vert3][0]);
+        glNormal3dv(&data->normal(vert3)[0]);
 
-      glVertex3dv(&vertices[vert3][0]);
+      glVertex3dv(&c[0]);
     }
     glEnd();
 